@@ -1,6 +1,7 @@
 /*
  * A part of the code was reused from my hand-in for 'Imperative Programming'.
  */
+#define _GNU_SOURCE //accept4
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -9,39 +10,237 @@
 #include <signal.h>
 #include <unistd.h>  //fork
 #include <sys/wait.h> //waitpid
+#include <fcntl.h>
+#include <libgen.h> //dirname
+#include <pthread.h>
+#include <sys/mman.h>
+#include <malloc.h> //mallinfo2, malloc_usable_size
+#include <sys/stat.h> //stat, mkdir
+#include <dirent.h> //opendir
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h> //sockaddr_un
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <poll.h>
 
 #define INIT_SIZE 10
 #define GROW_BY 5
 #define MANAGE_LIMIT 5
 #define BUFFER_SIZE 128 // size of buffer for input processing (maximum accepted text length = BUFFER_SIZE - 1)
 #define PROC_MAX 10 // max. number of inspectors
+#define COMMIT_INTERVAL_MS 200 // edits within this window are saved together with a single write + fsync
+#define STORE_MAX_RECORDS (1 << 20) // number of record slots reserved in the shared store (pages are only used when touched)
+#define AREA_MAX 64 // max. number of interned areas
+#define AREA_INDEX_SIZE 128 // slots of the area hash table, a power of 2 above AREA_MAX keeps the probes short
+#define AREA_CATALOGUE "areas.csv" // default file of the valid areas and their inspectors
+#define NO_SLOT (-1) // marks a removed record in the iterator
+#define PATH_SIZE (2 * BUFFER_SIZE + 8) // linked directory + '/' + area name + ".csv"
+#define SHARD_WORKERS 8 // max. number of threads loading or saving the shards of a linked directory
+#define SERVER_THREADS_MAX 16 // max. number of event loops serving the clients, one per core is started
+#define SERVER_EVENTS 64 // events taken by an event loop at once
+#define REQUEST_SIZE 1024 // longest request line accepted from a client
+#define CLIENT_REQUESTS 16 // requests of a client answered per wakeup, so a pipelining client can't starve the others
+#define OWN_WRITES_MAX 128 // files saved recently by the background writer, the watcher ignores their events
+
+typedef long t_slot; /* offset of a record in the shared store (in slots) */
 
 typedef struct Person {
-    char name[BUFFER_SIZE], area[BUFFER_SIZE];
+    char name[BUFFER_SIZE];
+    int area; /* id of the interned area */
     unsigned applicationCount;
+    unsigned long version; /* bumped on every change of the record, 0 for a free slot */
 } t_person;
 
-typedef struct Result {
+/* A line of a shard, the area is interned only when the shards are merged into the store */
+typedef struct Row {
+    char name[BUFFER_SIZE];
+    char area[BUFFER_SIZE];
+    unsigned applicationCount;
+} t_row;
+
+/* A file of the linked directory holding the records of one area, loaded or saved by a shard worker */
+typedef struct Shard {
+    char path[PATH_SIZE];
+    t_row *rows; /* records read from the file */
+    size_t rowCount, rowSize;
+    bool misplaced; /* the file holds records of other areas too */
+    bool own; /* the file holds records of its own area, so saving that area rewrites it */
+    int area; /* area of the shard to save */
+    char *content; /* records to save */
+    size_t length;
+    bool failed;
+} t_shard;
+
+/* Shards shared by the workers, each worker takes the next one until none is left */
+typedef struct ShardQueue {
+    t_shard *shards;
+    size_t count;
+    size_t next;
+} t_shard_queue;
+
+typedef struct Area {
     char name[BUFFER_SIZE];
+    int inspector; /* index of the inspector controlling the area, -1 if the area isn't a valid one */
+    unsigned hash; /* hash of the name, compared before the names */
+} t_area;
+
+typedef struct Result {
+    t_slot slot;
     int collected;
+    int area; /* kept by the inspector, it doesn't read the store during a contest */
 } t_result;
 
-typedef struct {
-    const size_t count;
-    const char **areas;
-} t_inspector;
+enum { DELTA_ADD, DELTA_REMOVE, DELTA_MODIFY };
+
+/* A change of a contestant, sent from the judge to the inspector of the area */
+typedef struct Delta {
+    int op;
+    t_slot slot;
+    int area; /* area of the record when the changes were collected */
+} t_delta;
+
+/* What the judge knows about the contestant of a slot */
+typedef struct Contestant {
+    unsigned long version; /* version of the record the inspector got, 0 if it isn't contested */
+    int inspector;
+    int collected; /* eggs collected in the last contest */
+    bool dirty; /* the record changed since the last contest */
+} t_contestant;
+
+/* The record store is mapped as MAP_SHARED before forking, the inspectors get the slots and areas of their contestants.
+ * Records are referenced by their slot offsets, never by raw pointers. */
+typedef struct Store {
+    size_t areaCount, slotCount; /* interned areas / slots handed out so far */
+    unsigned long generation; /* the last version given to a record */
+    t_area areas[AREA_MAX];
+    int areaIndex[AREA_INDEX_SIZE]; /* open addressing hash table of the areas: id + 1, 0 if the slot is empty */
+    t_person slots[];
+} t_store;
+
+/* Memory usage of the record store, filled by getMemStats */
+typedef struct MemStats {
+    size_t liveRecords, recordBytes; /* records in the store / size of one record */
+    size_t slotsAllocated, slotsUsed, slotsFree; /* slots handed out / holding a record / waiting for reuse */
+    size_t iteratorSize, iteratorUsed, holes; /* iterator capacity / used positions / removed positions not compacted yet */
+    double holeRatio; /* holes / used positions */
+    size_t storeReserved, storeTouched; /* bytes reserved for the shared store / bytes of it in use */
+    size_t bookkeepingBytes; /* heap requested for the iterator, the free slots and the contest state */
+    size_t allocatorOverhead; /* heap used by the allocator on top of bookkeepingBytes */
+    size_t heapInUse, heapFree; /* whole process heap in use / free but kept by the allocator */
+    size_t peakRecords, peakBytes; /* the most records / store + bookkeeping bytes so far */
+} t_mem_stats;
+
+/* A name removed or renamed here, the watcher doesn't bring it back from a file saved before the edit */
+typedef struct Tombstone {
+    char name[BUFFER_SIZE];
+    unsigned long generation; /* dropped once this generation is saved */
+} t_tombstone;
+
+/* Identifies a version of a file, the files saved by the background writer are recognized by it */
+typedef struct FileId {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+} t_file_id;
+
+/* A connection of the server, served by the event loop which accepted it, so its requests are answered in order */
+typedef struct Client {
+    int fd;
+    char in[REQUEST_SIZE]; /* requests received, the last one may be incomplete */
+    size_t inLength;
+    char *out; /* replies not sent yet */
+    size_t outLength, outSent;
+    bool closing; /* the connection is closed once the replies are sent */
+    uint32_t events; /* what the event loop waits for, 0 if the socket isn't watched */
+    int done_fd; /* write end of the pipe of its event loop, the replies of the blocking requests are posted there */
+    struct Job *job; /* blocking request running off the event loop, NULL if there's none */
+} t_client;
+
+/* A request which may block for long, like sync or start, run by a thread of its own instead of the event loop */
+typedef struct Job {
+    t_client *client;
+    char request[REQUEST_SIZE];
+    char *reply;
+    size_t replyLength;
+    bool success; /* false on a fatal error of the store */
+} t_job;
 
 /* Global variables */
 struct {
     FILE *fp;
+    DIR *dir; /* the linked directory, the records are sharded into one file per area */
     char name[BUFFER_SIZE];
+    bool dirtyShards[AREA_MAX]; /* areas changed since the last save, only their shards are rewritten */
+    unsigned long savedGeneration; /* records with a newer version have edits which aren't saved yet */
+    t_tombstone *tombstones; /* names removed or renamed since the last save, guarded by the store lock */
+    size_t tombstoneCount, tombstoneSize;
 } linkedFile;
 
+/* Background writer saving the records into the linked file */
+struct {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t changed, saved;
+    unsigned long requested, written; /* generation of the edits requested to be saved / already saved */
+    unsigned long attempts; /* saves tried so far */
+    bool failed; /* the last save failed, its edits are still pending */
+    unsigned long snapshot; /* generation of the store when the records being saved were taken */
+    bool running;
+} persister = {.mutex = PTHREAD_MUTEX_INITIALIZER, .changed = PTHREAD_COND_INITIALIZER, .saved = PTHREAD_COND_INITIALIZER};
+
+/* Watcher of the linked file, applying the changes made by other programs */
+struct {
+    pthread_t thread;
+    int inotify_fd;
+    int stop_fds[2]; /* writing into it stops the watcher */
+    bool running;
+    pthread_mutex_t mutex; /* guards the own writes */
+    t_file_id ownWrites[OWN_WRITES_MAX]; /* ring buffer of the files saved by the background writer */
+    size_t ownWriteCount;
+} watcher = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/* Held for writing while the records are modified, the background writer and the listings read them under it */
+pthread_rwlock_t storeLock = PTHREAD_RWLOCK_INITIALIZER;
+
+/* Taken by the judge, the inspectors serve a single contest at a time */
+pthread_mutex_t contestLock = PTHREAD_MUTEX_INITIALIZER;
+
+t_store *store;
+
 struct {
-    t_person **iterator;
+    t_slot *iterator;
     int size, count, freed;
+    t_slot *freeSlots; /* slots of removed records, they are reused first */
+    int freeSlotCount, freeSlotSize;
+    size_t peakRecords, peakBytes; /* updated atomically, the memory report only read locks the store */
 } list;
 
+/* Server mode, serving the commands on a Unix domain socket */
+struct {
+    int fd; /* listening socket */
+    int stop_fds[2]; /* closing the write end stops the event loops */
+    pthread_t threads[SERVER_THREADS_MAX];
+    size_t threadCount;
+    pthread_mutex_t mutex; /* guards the fields below */
+    pthread_cond_t idle; /* signalled when a job is over */
+    size_t jobs; /* blocking requests running */
+    bool stopping; /* no more jobs are started */
+} server = {.mutex = PTHREAD_MUTEX_INITIALIZER, .idle = PTHREAD_COND_INITIALIZER};
+
+/* Long-lived inspectors, getting only the contestants changed since the previous contest */
+struct {
+    bool running;
+    size_t inspectorCount;
+    pid_t proc_ids[PROC_MAX];
+    int to_fds[PROC_MAX], from_fds[PROC_MAX]; /* judge -> inspector, inspector -> judge */
+    t_contestant *contestants; /* indexed by slot */
+    size_t size;
+    t_slot *dirty; /* slots changed since the last contest */
+    size_t dirtyCount, dirtySize;
+} contest;
+
 /* Input handling */
 bool checkedReadIntoBuffer(size_t, void *, const char *, bool (*)(const char *, void *), void *);
 bool lengthChecker(const char *, void *);
@@ -51,45 +250,119 @@ bool validAreaOrEmptyChecker(const char *, void *);
 bool lengthAndOnlyDigitsAndIsPositiveChecker(const char *, void *);
 /* All functions with bool return type return true on operation success, false otherwise. */
 bool run(void); /* The execution loop, handling the user input */
-bool startContest(void); /* Appends an item to the global Person *iterator */
+bool startContest(FILE *); /* Sends the changes to the inspectors and announces the winner */
+bool judgeContest(FILE *); /* Body of startContest, locks the store only while it collects the changes and the results */
+bool startContestEngine(void); /* Forks the long-lived inspectors */
+void stopContestEngine(void); /* Lets the inspectors exit and waits for them */
+void inspectorMain(size_t, int, int); /* Body of an inspector process */
 bool addItem(void); /* Appends an item to the global Person *iterator */
 bool removeItem(void); /* Deletes an item, identified by the persons name */
 bool changeItem(void); /* Modifies an item, identified by the persons name */
 bool manageAllocatedSpace(void); /* Moves the pointers up in the iterator, while keeping their relative position, when the freed space is >= 5 */
 bool listItems(void); /* Lists the items */
 bool listItemsWithArea(void); /* Lists the items */
+bool listMemoryUsage(void); /* Prints the memory usage and fragmentation of the store */
+/* The core of the commands, shared by the interactive loop and the server. They report into the given stream. */
+bool addRecord(FILE *, const char *, const char *, unsigned); /* Adds a record, if the name is free and the area is a valid one */
+bool removeRecords(FILE *, const char *); /* Deletes the records with the given name */
+bool modifyRecord(FILE *, const char *, const char *, const char *, unsigned); /* Changes the record with the given name, empty values and 0 keep the old ones */
+bool writeRecords(FILE *, const char *); /* Lists the records of the area, every record for NULL */
+bool writeMemoryUsage(FILE *); /* Reports the memory usage and fragmentation of the store */
+void getMemStats(t_mem_stats *); /* Collects the memory usage counters of the store */
+void trackPeakUsage(void); /* Updates the peak memory usage counters, a read lock of the store is enough */
+void raisePeak(size_t *, size_t); /* Atomically raises the peak counter to the value, never lowers it */
 bool linkToFile(const char *); /* Link current 'context' to file */
 bool unlinkFile(); /* Unlink from linked file. */
+bool syncFile(FILE *); /* Waits until every edit is saved into the linked file */
+bool isLinked(void); /* Whether the store is linked to a file or a directory */
 bool growIterator(int); /* Grows the global Person *iterator */
+bool createStore(const char *); /* Maps the shared record store and interns the valid areas of the catalogue file */
+bool loadAreaCatalogue(const char *); /* Interns the areas of the catalogue file with their inspectors, false if it can't be read */
+t_slot allocRecord(void); /* Hands out a free slot of the store, NO_SLOT if the store is full */
+void unallocRecord(t_slot); /* Takes back the slot just handed out by allocRecord, when the record couldn't be added */
+bool freeRecord(t_slot); /* Gives back the slot of a removed record, false if it's out of memory and the record is kept */
+bool touchRecord(t_slot); /* Gives a new version to a changed record, false if it's out of memory and the record mustn't be changed */
+bool markDirty(t_slot); /* Notes the slot for the next contest, false if it's out of memory */
+t_person *recordAt(int); /* The record at the given position of the iterator, NULL if it was removed */
+int findRecord(const char *); /* Position of the record with the given name in the iterator, -1 if there's no such record */
+int findArea(const char *); /* Id of the interned area, -1 if there's no such area (hash lookup) */
+int internArea(const char *); /* Id of the area, interning it when it's not known yet */
 bool askYesNo(const char *); /* Asks a yes or no question returning true on positive answer */
 bool exitExecution(void); /* exits the execution loop, frees the allocated storage */
 int getEntryCount(void); /* Grows the global Person *iterator */
 void loadDataFromFile(void);
-void saveDataToFile(void);
-void appendRecord(t_person *);
-void removeAllRecord(void);
-void reopenFile(void);
+void loadShards(void); /* Reads the shards of the linked directory in parallel and merges them into the store */
+bool saveDataToFile(const char *, const char *, size_t); /* Atomically replaces the file with the given content (temp file + fsync + rename) */
+bool saveShards(void); /* Rewrites the shards of the changed areas in parallel */
+char *serializeRecords(size_t *); /* Dumps the records into a newly allocated CSV buffer */
+void markShardDirty(int); /* Notes that the shard of the area has to be rewritten */
+void advanceSavedGeneration(unsigned long); /* Moves the saved generation up to the given one, never back */
+bool reserveTombstone(void); /* Makes room for one more tombstone, false if it's out of memory */
+void addTombstone(const char *, unsigned long); /* Remembers a name removed or renamed here until the generation is saved */
+bool isTombstone(const char *); /* Whether the name was removed or renamed here since the last save */
+void dropSavedTombstones(void); /* Forgets the tombstones of the generations already saved */
+void shardPath(char *, const char *); /* Path of the shard of the area in the linked directory */
+void runShardWorkers(void *(*)(void *), t_shard_queue *); /* Runs the worker on every shard of the queue, then waits for them */
+void *shardLoader(void *); /* Worker reading shard files into rows */
+void *shardSaver(void *); /* Worker writing the serialized shards */
+void scheduleSave(void); /* Hands the edits over to the background writer, they are saved with the next group commit */
+bool waitForSave(void); /* Blocks until the background writer has saved every scheduled edit, false if a save failed meanwhile */
+bool startPersister(void); /* Starts the background writer of the linked file */
+void stopPersister(void); /* Saves the pending edits and stops the background writer */
+void *persisterMain(void *); /* Body of the background writer thread */
+void startWatcher(void); /* Starts watching the linked file for the changes of other programs */
+void stopWatcher(void); /* Stops the watcher of the linked file */
+void *watcherMain(void *); /* Body of the watcher thread */
+void noteOwnWrite(const struct stat *); /* Remembers a file saved by the background writer */
+bool isOwnWrite(const struct stat *); /* Whether the file is the one the background writer saved */
+void applyFileChanges(const char *); /* Applies the changes of an edited file to the store, touching only the changed records */
+bool serve(const char *); /* Serves the commands on the Unix domain socket until SIGINT or SIGTERM */
+void *serverLoop(void *); /* Body of an event loop of the server */
+void handleClientEvent(int, t_client *); /* Serves the client of the event loop, closes it when the connection is over */
+bool serveClient(t_client *); /* Answers the requests received from the client, false if the connection is over */
+bool isBlockingRequest(const char *); /* Whether the request may block the event loop for long */
+void startJob(FILE *, t_client *, const char *); /* Runs the request in a thread of its own, its reply is posted to the event loop later */
+void *jobMain(void *); /* Body of a thread running a blocking request */
+bool flushClient(t_client *); /* Sends the pending replies of the client, false if the connection is broken */
+bool handleRequest(FILE *, char *); /* Runs a request line writing the reply, false on a fatal error of the store */
+void appendRecord(t_slot);
+bool removeAllRecord(void); /* false if it's out of memory, some records may be left */
 void noMemoryError(void); /* Handles memory shortage -> prints message to stderr */
 void fileError(const char *); /* Handles file errors -> prints message to stderr */
 void ipcError(const char *); /* Handles IPC errors -> prints message to stderr */
 void assertionError(const char*); /* Handles assertion errors -> prints message to stderr */
 static int randomBetween(int, int); /* gets a random number between [lower, upper] */
+static unsigned hashName(const char *); /* FNV-1a hash of the name */
+static size_t findRowSlot(const size_t *, size_t, const t_row *, const char *); /* Slot of the name in the row index, an empty slot if it isn't there */
+static size_t findRecordSlot(const size_t *, size_t, const char *); /* Slot of the name in the record index, an empty slot if it isn't there */
+static int splitFields(char *, char **, int); /* Splits the arguments of a request at ';', -1 if there are more than the given fields */
 static void emptyBuffer(void); /* empties buffer if it's overloaded (if fgets wasn't able to put \n in the array) */
 
-static size_t contestCount = 0;
-static void startHandler(int sig, siginfo_t *si, void *ucontext)
+int main(int argc, char *argv[])
 {
-    contestCount = si->si_value.sival_int;
-}
+    const char *socketPath = NULL, *linkPath = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:l:")) != -1) {
+        switch (opt) {
+            case 's': socketPath = optarg; break;
+            case 'l': linkPath = optarg; break;
+            default:
+                fprintf(stderr, "Usage: %s [-l linked_file] [-s socket] [area_catalogue]\n", argv[0]);
+                return 1;
+        }
+    }
 
-int main(void)
-{
-    // set signal handler of contest start
-    struct sigaction sa;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_sigaction = startHandler;
-    sa.sa_flags = SA_SIGINFO;
-    sigaction(SIGUSR1, &sa, NULL);
+    // the catalogue of the valid areas can be given as the only argument
+    if (!createStore(optind < argc ? argv[optind] : AREA_CATALOGUE)) return 1;
+    if (!growIterator(INIT_SIZE) /* Initial allocation */ || (linkPath && !linkToFile(linkPath))) {
+        exitExecution();
+        return 1;
+    }
+    if (socketPath) {
+        if (serve(socketPath)) return 0;
+        exitExecution();
+        return 1;
+    }
 
     printf("*******************************************************************************************\n"
            "***************************************** MANUAL ******************************************\n"
@@ -100,14 +373,19 @@ int main(void)
            "***                                                                                     ***\n"
            "**************************************** COMMANDS *****************************************\n"
            "***    link   – Links the application data store to a file. By default the data store   ***\n"
-           "***             is not linked.                                                          ***\n"
+           "***             is not linked. If a directory is given, every area is kept in its own   ***\n"
+           "***             file of it, and only the files of the changed areas are rewritten.      ***\n"
            "***                                                                                     ***\n"
            "***    unlink – Unlinks the application data store from the file.                       ***\n"
            "***                                                                                     ***\n"
+           "***    sync   – Waits until every change is saved into the linked file.                 ***\n"
+           "***                                                                                     ***\n"
            "***    ls     – Lists the stored records.                                               ***\n"
            "***                                                                                     ***\n"
            "***    filter – Lists the records where 'area' equals to the one given in parameter.    ***\n"
            "***                                                                                     ***\n"
+           "***    mem    – Shows the memory usage and fragmentation of the data store.             ***\n"
+           "***                                                                                     ***\n"
            "***    start  – Starts the contest.                                                     ***\n"
            "***                                                                                     ***\n"
            "***    add    – Adds a new record to the data store.                                    ***\n"
@@ -122,7 +400,10 @@ int main(void)
            "*******************************************************************************************\n"
     );
 
-    return !run();
+    // the error helpers only report, the store is released here after a failure
+    if (run()) return 0;
+    exitExecution();
+    return 1;
 }
 
 bool run(void){
@@ -136,7 +417,7 @@ bool run(void){
             if(strlen(cmd_buffer) == 0) continue;
 
             if (strcmp(cmd_buffer, "start") == 0){
-                if(!startContest()) return false;
+                if(!startContest(stdout)) return false;
             }
             else if (strcmp(cmd_buffer, "add") == 0){
                 if(!addItem()) return false;
@@ -153,12 +434,18 @@ bool run(void){
             else if (strcmp(cmd_buffer, "filter") == 0){
                 if (!listItemsWithArea()) return false;
             }
+            else if (strcmp(cmd_buffer, "mem") == 0){
+                if (!listMemoryUsage()) return false;
+            }
             else if (strcmp(cmd_buffer, "link") == 0){
                 if (!linkToFile(NULL)) return false;
             }
             else if (strcmp(cmd_buffer, "unlink") == 0){
                 if (!unlinkFile()) return false;
             }
+            else if (strcmp(cmd_buffer, "sync") == 0){
+                if (!syncFile(stdout)) return false;
+            }
             else if (strcmp(cmd_buffer, "quit") == 0){
                 return exitExecution();
             }
@@ -181,26 +468,18 @@ bool lengthAndAlreadyExistsChecker(const char *input, void *args){
     if (!(((size_t*)args)[0] <= len && len <= ((size_t*)args)[1]))
         return false;
 
-    for (int i = 0; i < list.count; ++i) {
-        if (list.iterator[i] && strcmp(input, list.iterator[i]->name) == 0){
-            return false;
-        }
-    }
-
-    return true;
+    pthread_rwlock_rdlock(&storeLock);
+    bool exists = findRecord(input) >= 0;
+    pthread_rwlock_unlock(&storeLock);
+    return !exists;
 }
 
 bool validAreaChecker(const char *input, void *args){
-    static const char* validAreas[] = {"Barátfa", "Lovas", "Szula", "Kígyós-patak", "Malom telek", "Páskom", "Káposztás kert"};
-    static size_t len = sizeof(validAreas) / sizeof(validAreas[0]);
-
-    for (size_t i = 0; i < len; ++i) {
-        if (strcmp(input, validAreas[i]) == 0){
-            return true;
-        }
-    }
-
-    return false;
+    pthread_rwlock_rdlock(&storeLock);
+    int area = findArea(input);
+    bool valid = area >= 0 && store->areas[area].inspector >= 0;
+    pthread_rwlock_unlock(&storeLock);
+    return valid;
 }
 
 bool validAreaOrEmptyChecker(const char *input, void *args){
@@ -254,145 +533,269 @@ bool checkedReadIntoBuffer(size_t length, void *dest, const char *prompt,
     return keepRecord;
 }
 
-bool startContest(void) {
-    static const char *areas1[] = {"Barátfa", "Lovas", "Kígyós-patak", "Káposztás kert"};
-    static const char *areas2[] = {"Szula", "Malom telek", "Páskom"};
-    static const t_inspector inspectors[] = {{4, areas1}, {3, areas2}};
-    static const size_t inspectorCount = sizeof(inspectors) / sizeof(inspectors[0]);
+bool startContest(FILE *out) {
+    // the inspectors serve one judge at a time
+    pthread_mutex_lock(&contestLock);
+    bool success = judgeContest(out);
+    pthread_mutex_unlock(&contestLock);
+
+    return success;
+}
 
-    if (getEntryCount() <= 0){
-        printf("Please add rabbits first!\n");
+bool judgeContest(FILE *out) {
+    pthread_rwlock_rdlock(&storeLock);
+    int entryCount = getEntryCount();
+    pthread_rwlock_unlock(&storeLock);
+    if (entryCount <= 0){
+        fprintf(out, "Please add rabbits first!\n");
         return true;
     }
 
-    pid_t proc_ids[PROC_MAX];
-    int pipe_fds[PROC_MAX][2];
+    if (!contest.running && !startContestEngine()) return false;
 
-    for (size_t i = 0; i < inspectorCount; ++i) {
-        if (pipe(pipe_fds[i]) == -1) { ipcError("Pipe creation was unsuccessful."); return false; }
-        if ((proc_ids[i] = fork()) < 0) { ipcError("Forking was unsuccessful."); return false; }
+    /* Judge ("Főnyuszi") */
 
-        if (proc_ids[i] == 0) {
-            /* child (inspector) */
+    // collect the changes since the previous contest for every inspector
+    fprintf(out, "Sending the changed records to their inspectors according to area...\n");
+
+    // the edits wait only while the changes are copied, not while the inspectors contest
+    t_delta *deltas[PROC_MAX] = {NULL};
+    size_t deltaCount[PROC_MAX] = {0};
+    pthread_rwlock_rdlock(&storeLock);
+    for (size_t i = 0; i < contest.inspectorCount; ++i) {
+        deltas[i] = (t_delta *) malloc((contest.dirtyCount * 2 + 1) * sizeof(t_delta));
+        if (!deltas[i]) {
+            pthread_rwlock_unlock(&storeLock);
+            while (i > 0) free(deltas[--i]);
+            noMemoryError();
+            return false;
+        }
+    }
 
-            srand(time(NULL) ^ (getpid()<<16)); // seed random
-            pause(); // wait until contest starts
+    for (size_t i = 0; i < contest.dirtyCount; ++i) {
+        t_slot slot = contest.dirty[i];
+        t_contestant *contestant = &contest.contestants[slot];
+        t_person *record = &store->slots[slot];
+        int inspector = record->version != 0 ? store->areas[record->area].inspector : -1;
 
-            // read contestant's information from unnamed pipe
-            t_person *persons = (t_person *) malloc(contestCount * sizeof(t_person));
+        if (contestant->version != 0 && contestant->inspector == inspector) {
+            deltas[inspector][deltaCount[inspector]++] = (t_delta){DELTA_MODIFY, slot, record->area};
+        } else {
+            if (contestant->version != 0)
+                deltas[contestant->inspector][deltaCount[contestant->inspector]++] = (t_delta){DELTA_REMOVE, slot, -1};
+            if (inspector >= 0)
+                deltas[inspector][deltaCount[inspector]++] = (t_delta){DELTA_ADD, slot, record->area};
+        }
+
+        contestant->version = inspector >= 0 ? record->version : 0;
+        contestant->inspector = inspector;
+        contestant->dirty = false;
+    }
+    contest.dirtyCount = 0;
+    pthread_rwlock_unlock(&storeLock);
+
+    // every inspector gets its changes, the ones without changes keep their previous results
+    for (size_t i = 0; i < contest.inspectorCount; ++i) {
+        write(contest.to_fds[i], &deltaCount[i], sizeof(size_t));
+        write(contest.to_fds[i], deltas[i], deltaCount[i] * sizeof(t_delta));
+        free(deltas[i]);
+    }
+
+    // collect the results which changed
+    t_person winner; // copied, the slot may be reused once the store is unlocked
+    int mostEggs = -1;
+    for (size_t i = 0; i < contest.inspectorCount; ++i) {
+        size_t resultCount;
+        if (read(contest.from_fds[i], &resultCount, sizeof(size_t)) != sizeof(size_t)) {
+            ipcError("Inspector has exited unexpectedly.");
+            return false;
+        }
 
-            for (size_t j = 0; j < contestCount; ++j) {
-                read(pipe_fds[i][0], &persons[j], sizeof(t_person));
+        // the results follow their count right away, the lock isn't held while the inspector contests
+        pthread_rwlock_rdlock(&storeLock);
+        for (size_t j = 0; j < resultCount; ++j) {
+            t_result result;
+            read(contest.from_fds[i], &result, sizeof(result));
+            contest.contestants[result.slot].collected = result.collected;
+        }
+
+        fprintf(out, "Judge got the results from inspector %lu. They are:", i+1); fflush(out);
+        for (int j = 0; j < list.count; ++j) {
+            t_slot slot = list.iterator[j];
+            // a record changed during the contest is contested again at the next start
+            if (slot != NO_SLOT && contest.contestants[slot].version != 0 && contest.contestants[slot].inspector == (int)i &&
+                contest.contestants[slot].version == store->slots[slot].version) {
+                fprintf(out, "\n\t%-14s (%-3d eggs)", store->slots[slot].name, contest.contestants[slot].collected);
+
+                if (contest.contestants[slot].collected > mostEggs){
+                    winner = store->slots[slot];
+                    mostEggs = contest.contestants[slot].collected;
+                }
             }
-            close(pipe_fds[i][0]);
+        }
+        fprintf(out, "\n"); fflush(out);
+        pthread_rwlock_unlock(&storeLock);
+    }
 
-            printf("Inspector %lu. received the information of the participants.\n", i+1);
-            fflush(stdout);
+    if (mostEggs >= 0){
+        fprintf(out, "\n~~~~~~~~~ The Winner is: %s (with %d eggs)! ~~~~~~~~~\n", winner.name, mostEggs); fflush(out);
+    }
 
-            sleep(randomBetween(1,3)); // prepare for the contest
-            printf("Contest started in the area of inspector %lu.\n", i+1);
-            fflush(stdout);
+    return true;
+}
 
-            // send back the contest results in the related areas
-            sleep(randomBetween(1,5)); // duration of the contest
+bool startContestEngine(void) {
+    contest.inspectorCount = 0;
+    pthread_rwlock_rdlock(&storeLock); // the loaders may intern areas meanwhile, the forks happen unlocked
+    for (size_t i = 0; i < store->areaCount; ++i) {
+        if (store->areas[i].inspector >= (int)contest.inspectorCount)
+            contest.inspectorCount = store->areas[i].inspector + 1;
+    }
+    pthread_rwlock_unlock(&storeLock);
 
-            printf("Inspector %lu. sends back the results to the judge...\n", i+1);
-            fflush(stdout);
-            sleep(randomBetween(1,3)); // summarize
+    fflush(stdout); // so the children won't repeat the buffered output
 
-            for (size_t j = 0; j < contestCount; ++j) {
-                t_result result;
-                strncpy(result.name, persons[j].name, BUFFER_SIZE);
-                result.collected = randomBetween(1, 100);
+    for (size_t i = 0; i < contest.inspectorCount; ++i) {
+        int to_inspector[2], from_inspector[2];
+        if (pipe(to_inspector) == -1 || pipe(from_inspector) == -1) { ipcError("Pipe creation was unsuccessful."); return false; }
+        if ((contest.proc_ids[i] = fork()) < 0) { ipcError("Forking was unsuccessful."); return false; }
 
-                write(pipe_fds[i][1], &result, sizeof(result));
+        if (contest.proc_ids[i] == 0) {
+            /* child (inspector) */
+            for (size_t j = 0; j < i; ++j) { // pipes of the previous inspectors belong to the judge
+                close(contest.to_fds[j]);
+                close(contest.from_fds[j]);
             }
-            close(pipe_fds[i][1]);
+            close(to_inspector[1]);
+            close(from_inspector[0]);
 
-            free(persons);
+            inspectorMain(i, to_inspector[0], from_inspector[1]);
             _exit(0);
         }
+
+        close(to_inspector[0]);
+        close(from_inspector[1]);
+        contest.to_fds[i] = to_inspector[1];
+        contest.from_fds[i] = from_inspector[0];
     }
 
-    /* Judge ("Főnyuszi") */
+    contest.running = true;
+    return true;
+}
+
+void stopContestEngine(void) {
+    if (contest.running){
+        // closing the pipes tells the inspectors that there won't be more contests
+        for (size_t i = 0; i < contest.inspectorCount; ++i) {
+            close(contest.to_fds[i]);
+            close(contest.from_fds[i]);
+        }
+        for (size_t i = 0; i < contest.inspectorCount; ++i) {
+            waitpid(contest.proc_ids[i], NULL, 0);
+        }
+        contest.running = false;
+    }
+}
 
-    // send controlled areas for inspectors
-    printf("Sending records to their inspectors according to area...\n");
+void inspectorMain(size_t id, int in_fd, int out_fd) {
+    srand(time(NULL) ^ (getpid()<<16)); // seed random
 
-    sleep(2);
-    size_t contestantCount[PROC_MAX] = {0};
+    // the contestants of the inspector, with the areas the judge sent, the store may change during a contest
+    t_result *contestants = NULL;
+    long *position = NULL; /* index of the slot in contestants, indexed by slot */
+    size_t count = 0, size = 0, positionSize = 0;
 
-    for (int i = 0; i < list.count; ++i) {
-        for (size_t j = 0; j < inspectorCount; ++j) {
-            for (size_t k = 0; k < inspectors[j].count; ++k) {
-                if (list.iterator[i] && strcmp(inspectors[j].areas[k], list.iterator[i]->area) == 0) {
-                    write(pipe_fds[j][1], list.iterator[i], sizeof(t_person));
-                    contestantCount[j]++;
+    size_t deltaCount;
+    while (read(in_fd, &deltaCount, sizeof(size_t)) == sizeof(size_t)) {
+        bool affected[AREA_MAX] = {false};
+
+        for (size_t i = 0; i < deltaCount; ++i) {
+            t_delta delta;
+            read(in_fd, &delta, sizeof(delta));
+
+            if (delta.slot >= (long)positionSize) {
+                size_t newSize = positionSize * 2 > (size_t)delta.slot ? positionSize * 2 : (size_t)delta.slot + 1;
+                long *tmp = (long *) realloc(position, newSize * sizeof(long));
+                if (!tmp) _exit(1);
+                position = tmp;
+                positionSize = newSize;
+            }
+
+            if (delta.op == DELTA_ADD) {
+                if (count == size) {
+                    size = size * 2 + INIT_SIZE;
+                    t_result *tmp = (t_result *) realloc(contestants, size * sizeof(t_result));
+                    if (!tmp) _exit(1);
+                    contestants = tmp;
                 }
+                position[delta.slot] = (long)count;
+                contestants[count].slot = delta.slot;
+                contestants[count++].collected = -1;
+            } else if (delta.op == DELTA_REMOVE) {
+                // move the last one into the place of the removed contestant
+                long removed = position[delta.slot];
+                contestants[removed] = contestants[--count];
+                position[contestants[removed].slot] = removed;
+                continue; // a removed record doesn't need a new contest
             }
-        }
-    }
 
-    // notify children that the contest started, and send the nr. of contestants
-    for (size_t i = 0; i < inspectorCount; ++i) {
-        close(pipe_fds[i][1]);
+            contestants[position[delta.slot]].area = delta.area;
+            affected[delta.area] = true;
+        }
 
-        union sigval sv = {0};
-        sv.sival_int = (int)contestantCount[i];
-        sigqueue(proc_ids[i], SIGUSR1, sv);
-    }
+        // only the areas with changes are contested again
+        size_t resultCount = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (affected[contestants[i].area]) resultCount++;
+        }
 
-    // wait until inspectors are done
-    pid_t finished_pid;
-    t_result winner; winner.collected = -1;
-    while ((finished_pid = waitpid(-1, NULL, 0)) != -1) {
-        for (size_t i = 0; i < inspectorCount; ++i) {
-            if (proc_ids[i] == finished_pid){
-                // an inspector has finished
-                printf("Judge got the results from inspector %lu. They are:", i+1); fflush(stdout);
+        if (resultCount == 0) {
+            printf("Inspector %lu. has no changes, the previous results stand.\n", id+1);
+            fflush(stdout);
+        } else {
+            printf("Inspector %lu. received the information of %lu changed participants.\n", id+1, deltaCount);
+            fflush(stdout);
 
-                int *pipe_fd = pipe_fds[i];
+            sleep(randomBetween(1,3)); // prepare for the contest
+            printf("Contest started in the area of inspector %lu.\n", id+1);
+            fflush(stdout);
 
-                for (size_t j = 0; j < contestantCount[i]; ++j) {
-                    t_result result;
-                    read(pipe_fd[0], &result, sizeof(result));
+            sleep(randomBetween(1,5)); // duration of the contest
 
-                    printf("\n\t%-14s (%-3d eggs)", result.name, result.collected); fflush(stdout);
+            printf("Inspector %lu. sends back the results to the judge...\n", id+1);
+            fflush(stdout);
+            sleep(randomBetween(1,3)); // summarize
+        }
 
-                    if (result.collected > winner.collected){
-                        winner.collected = result.collected;
-                        strncpy(winner.name, result.name, BUFFER_SIZE);
-                    }
-                }
-                printf("\n"); fflush(stdout);
-                close(pipe_fd[0]);
+        // send back the results of the areas contested again
+        write(out_fd, &resultCount, sizeof(size_t));
+        for (size_t i = 0; i < count; ++i) {
+            if (affected[contestants[i].area]) {
+                contestants[i].collected = randomBetween(1, 100);
+                write(out_fd, &contestants[i], sizeof(t_result));
             }
         }
     }
 
-    if (getEntryCount() > 0){
-        printf("\n~~~~~~~~~ The Winner is: %s (with %d eggs)! ~~~~~~~~~\n", winner.name, winner.collected); fflush(stdout);
-    }
-
-    return true;
+    close(in_fd);
+    close(out_fd);
+    free(contestants);
+    free(position);
 }
 
 bool addItem(void){
-    t_person *newRecord = (t_person *) malloc(sizeof(t_person));
-    if (!newRecord){
-        noMemoryError();
-        return false;
-    }
+    t_person newRecord; // only the name is used
+    char areaBuffer[BUFFER_SIZE];
 
     // read name
     size_t args[2] = {1, BUFFER_SIZE - 1}; // minLength, maxLength
-    if (!checkedReadIntoBuffer(BUFFER_SIZE, newRecord->name, ">> Name: ", lengthAndAlreadyExistsChecker, args)){
+    if (!checkedReadIntoBuffer(BUFFER_SIZE, newRecord.name, ">> Name: ", lengthAndAlreadyExistsChecker, args)){
         printf("Dropping record...\n");
         return true;
     }
 
     // read area
-    if (!checkedReadIntoBuffer(BUFFER_SIZE, newRecord->area, ">> Area: ", validAreaChecker, NULL)){
+    if (!checkedReadIntoBuffer(BUFFER_SIZE, areaBuffer, ">> Area: ", validAreaChecker, NULL)){
         printf("Dropping record...\n");
         return true;
     }
@@ -403,16 +806,37 @@ bool addItem(void){
     if (!checkedReadIntoBuffer(6, num_buffer, ">> Application count: ", lengthAndOnlyDigitsAndIsPositiveChecker, args2)){
         printf("Dropping record...\n");
         return true;
-    } else {
-        newRecord->applicationCount = atoi(num_buffer);
     }
 
-    appendRecord(newRecord);
+    return addRecord(stdout, newRecord.name, areaBuffer, atoi(num_buffer));
+}
 
-    if (linkedFile.fp != NULL) {
-        saveDataToFile();
+bool addRecord(FILE *out, const char *name, const char *areaName, unsigned applicationCount){
+    // the name is checked again under the lock, another client may have taken it meanwhile
+    pthread_rwlock_wrlock(&storeLock);
+    int area = findArea(areaName);
+    t_slot slot = NO_SLOT;
+    if (findRecord(name) >= 0) {
+        fprintf(out, "'%s' is already in the data store, dropping record...\n", name);
+    } else if (area < 0 || store->areas[area].inspector < 0) {
+        fprintf(out, "'%s' isn't a valid area, dropping record...\n", areaName);
+    } else if ((slot = allocRecord()) == NO_SLOT) {
+        fprintf(out, "The data store is full, dropping record...\n");
+    } else if (!touchRecord(slot)) {
+        unallocRecord(slot);
+        slot = NO_SLOT;
+        fprintf(out, "Out of memory, dropping record...\n");
+    } else {
+        t_person *newRecord = &store->slots[slot];
+        strncpy(newRecord->name, name, BUFFER_SIZE);
+        newRecord->area = area;
+        newRecord->applicationCount = applicationCount;
+        appendRecord(slot);
+        markShardDirty(area);
     }
+    pthread_rwlock_unlock(&storeLock);
 
+    if (slot != NO_SLOT) scheduleSave();
     return true;
 }
 
@@ -425,25 +849,40 @@ bool removeItem(void){
         return true;
     }
 
-    bool success = true;
+    return removeRecords(stdout, tmp);
+}
+
+bool removeRecords(FILE *out, const char *name){
+    bool success = true, kept;
     int dropped = 0;
-    for (int i = 0; i < list.count; ++i) {
-        if (list.iterator[i] && strcmp(tmp, list.iterator[i]->name) == 0){
-            free(list.iterator[i]);
-            list.iterator[i] = NULL;
+    pthread_rwlock_wrlock(&storeLock);
+    kept = !reserveTombstone(); // the watcher mustn't bring the record back before it's saved
+    for (int i = 0; i < list.count && !kept; ++i) {
+        t_person *record = recordAt(i);
+        if (record && strcmp(name, record->name) == 0){
+            int area = record->area;
+            if (!freeRecord(list.iterator[i])) {
+                kept = true;
+                break;
+            }
+            markShardDirty(area);
+            list.iterator[i] = NO_SLOT;
             list.freed++;
             dropped++;
         }
     }
     if (dropped > 0){
-        if (linkedFile.fp != NULL) {
-            saveDataToFile();
-        }
-
+        addTombstone(name, ++store->generation);
         success = manageAllocatedSpace();
-        printf("Dropped %d record.\n", dropped);
     }
-    else printf("No record to delete.\n");
+    pthread_rwlock_unlock(&storeLock);
+
+    if (dropped > 0){
+        scheduleSave();
+        fprintf(out, "Dropped %d record.\n", dropped);
+    }
+    if (kept) fprintf(out, "Out of memory, the record wasn't deleted.\n");
+    else if (dropped == 0) fprintf(out, "No record to delete.\n");
 
     return success;
 }
@@ -458,73 +897,87 @@ bool changeItem(void){
         return true;
     }
 
-    for (int i = 0; i < list.count; ++i) {
-        if (list.iterator[i] && strcmp(tmp, list.iterator[i]->name) == 0){
-            t_person tmpRec;
-            /* Ask for new data */
-            size_t args2[2] = {0, BUFFER_SIZE - 1};
-            sprintf(prompt_text, "[CHANGE: NAME][PREVIOUS: %s]>> ", list.iterator[i]->name);
-            if (!checkedReadIntoBuffer(BUFFER_SIZE, tmpRec.name, prompt_text, lengthAndAlreadyExistsChecker, args2)){
-                printf("Record wasn't modified.\n");
-                return true;
-            }
+    // only the name is kept across the prompts, the record may be changed or removed by others meanwhile
+    t_person previous;
+    char previousArea[BUFFER_SIZE];
+    pthread_rwlock_rdlock(&storeLock);
+    int i = findRecord(tmp);
+    if (i >= 0) {
+        previous = *recordAt(i);
+        snprintf(previousArea, BUFFER_SIZE, "%s", store->areas[previous.area].name);
+    }
+    pthread_rwlock_unlock(&storeLock);
+    if (i < 0) {
+        printf("No record to change.\n");
+        return true;
+    }
 
-            // read area
-            sprintf(prompt_text, "[CHANGE: AREA][PREVIOUS: %s]>> ", list.iterator[i]->area);
-            if (!checkedReadIntoBuffer(BUFFER_SIZE, tmpRec.area, prompt_text, validAreaOrEmptyChecker, NULL)){
-                printf("Record wasn't modified.\n");
-                return true;
-            }
+    t_person tmpRec; // only the name is used
+    char areaBuffer[BUFFER_SIZE];
+    /* Ask for new data */
+    size_t args2[2] = {0, BUFFER_SIZE - 1};
+    sprintf(prompt_text, "[CHANGE: NAME][PREVIOUS: %s]>> ", previous.name);
+    if (!checkedReadIntoBuffer(BUFFER_SIZE, tmpRec.name, prompt_text, lengthAndAlreadyExistsChecker, args2)){
+        printf("Record wasn't modified.\n");
+        return true;
+    }
 
-            // read application count
-            size_t args3[2] = {0, 5}; // minLength, maxLength
-            char num_buffer[6];
-            sprintf(prompt_text, "[CHANGE: APPLICATION_COUNT][PREVIOUS: %d]>> ", list.iterator[i]->applicationCount);
-            if (!checkedReadIntoBuffer(6, num_buffer, prompt_text, lengthAndOnlyDigitsAndIsPositiveChecker, args3)){
-                printf("Record wasn't modified.\n");
-                return true;
-            } else {
-                if (strlen(num_buffer) == 0)
-                    tmpRec.applicationCount = list.iterator[i]->applicationCount;
-                else
-                    tmpRec.applicationCount = atoi(num_buffer);
-            }
+    // read area
+    sprintf(prompt_text, "[CHANGE: AREA][PREVIOUS: %s]>> ", previousArea);
+    if (!checkedReadIntoBuffer(BUFFER_SIZE, areaBuffer, prompt_text, validAreaOrEmptyChecker, NULL)){
+        printf("Record wasn't modified.\n");
+        return true;
+    }
 
-            /* Copy data into record */
-            if(strlen(tmpRec.name) != 0) // if empty leave the original
-                strncpy(list.iterator[i]->name, tmpRec.name, BUFFER_SIZE);
-            if(strlen(tmpRec.area) != 0) // if empty leave the original
-                strncpy(list.iterator[i]->area, tmpRec.area, BUFFER_SIZE);
-            list.iterator[i]->applicationCount = tmpRec.applicationCount;
+    // read application count
+    size_t args3[2] = {0, 5}; // minLength, maxLength
+    char num_buffer[6];
+    sprintf(prompt_text, "[CHANGE: APPLICATION_COUNT][PREVIOUS: %d]>> ", previous.applicationCount);
+    if (!checkedReadIntoBuffer(6, num_buffer, prompt_text, lengthAndOnlyDigitsAndIsPositiveChecker, args3)){
+        printf("Record wasn't modified.\n");
+        return true;
+    }
 
-            if (linkedFile.fp != NULL) {
-                saveDataToFile();
-            }
+    return modifyRecord(stdout, tmp, tmpRec.name, areaBuffer, atoi(num_buffer)); // atoi("") = 0 keeps the count
+}
 
-            return true;
+bool modifyRecord(FILE *out, const char *name, const char *newName, const char *areaName, unsigned applicationCount){
+    pthread_rwlock_wrlock(&storeLock);
+    int i = findRecord(name);
+    int area = strlen(areaName) != 0 ? findArea(areaName) : -1;
+    bool changed = false;
+    if (i < 0) {
+        fprintf(out, "No record to change.\n");
+    } else if (strlen(newName) != 0 && strcmp(newName, name) != 0 && findRecord(newName) >= 0) {
+        fprintf(out, "'%s' is already in the data store, record wasn't modified.\n", newName);
+    } else if (strlen(areaName) != 0 && (area < 0 || store->areas[area].inspector < 0)) {
+        fprintf(out, "'%s' isn't a valid area, record wasn't modified.\n", areaName);
+    } else if (!reserveTombstone() || !touchRecord(list.iterator[i])) {
+        fprintf(out, "Out of memory, record wasn't modified.\n");
+    } else {
+        /* Copy data into record */
+        t_person *record = recordAt(i);
+        markShardDirty(record->area); // the record may move into the shard of another area
+        if(strlen(newName) != 0 && strcmp(newName, record->name) != 0) { // if empty leave the original
+            addTombstone(record->name, record->version); // the old name is gone
+            strncpy(record->name, newName, BUFFER_SIZE);
         }
+        if(area >= 0) // if empty leave the original
+            record->area = area;
+        if(applicationCount > 0) // if empty leave the original
+            record->applicationCount = applicationCount;
+        markShardDirty(record->area);
+        changed = true;
     }
+    pthread_rwlock_unlock(&storeLock);
 
-
-    printf("No record to change.\n");
+    if (changed) scheduleSave();
     return true;
 }
 
 bool listItems(void){
     fflush(stdout);
-    printf("\n===================================== %d entries =====================================\n", getEntryCount());
-    printf("%-40s%-30s  %-30s", "[Name]", "[Area]", "[Application Count]");
-    if (getEntryCount() > 0) {
-        for (int i = 0; i < list.count; ++i) {
-            if (list.iterator[i]) {
-                printf("\n%-40s", list.iterator[i]->name);
-                printf("%-30s\t", list.iterator[i]->area);
-                printf("%-30d", list.iterator[i]->applicationCount);
-            }
-        }
-    }
-    printf("\n\n");
-    return true;
+    return writeRecords(stdout, NULL);
 }
 
 bool listItemsWithArea(void){
@@ -535,23 +988,112 @@ bool listItemsWithArea(void){
     }
 
     fflush(stdout);
-    printf("\n===================================== Rabbits in '%s' =====================================\n", areaInput);
-    printf("%-40s%-30s  %-30s", "[Name]", "[Area]", "[Application Count]");
-    for (int i = 0; i < list.count; ++i) {
-        if (list.iterator[i] && strcmp(areaInput, list.iterator[i]->area) == 0) {
-            printf("\n%-40s", list.iterator[i]->name);
-            printf("%-30s\t", list.iterator[i]->area);
-            printf("%d", list.iterator[i]->applicationCount);
+    return writeRecords(stdout, areaInput);
+}
+
+bool writeRecords(FILE *out, const char *areaName){
+    pthread_rwlock_rdlock(&storeLock);
+    int area = areaName ? findArea(areaName) : -1;
+    if (areaName)
+        fprintf(out, "\n===================================== Rabbits in '%s' =====================================\n", areaName);
+    else
+        fprintf(out, "\n===================================== %d entries =====================================\n", getEntryCount());
+    fprintf(out, "%-40s%-30s  %-30s", "[Name]", "[Area]", "[Application Count]");
+    for (int i = 0; (!areaName || area >= 0) && i < list.count; ++i) {
+        t_person *record = recordAt(i);
+        if (record && (!areaName || record->area == area)) {
+            fprintf(out, "\n%-40s", record->name);
+            fprintf(out, "%-30s\t", store->areas[record->area].name);
+            fprintf(out, "%-30d", record->applicationCount);
         }
     }
-    printf("\n\n");
+    fprintf(out, "\n\n");
+    pthread_rwlock_unlock(&storeLock);
+    return true;
+}
+
+bool listMemoryUsage(void){
+    return writeMemoryUsage(stdout);
+}
+
+bool writeMemoryUsage(FILE *out){
+    t_mem_stats stats;
+    pthread_rwlock_rdlock(&storeLock);
+    getMemStats(&stats);
+    pthread_rwlock_unlock(&storeLock);
+
+    fprintf(out, "\n===================================== Memory usage =====================================\n");
+    fprintf(out, "%-40s%lu\n", "Live records:", stats.liveRecords);
+    fprintf(out, "%-40s%lu\n", "Bytes per record:", stats.recordBytes);
+    fprintf(out, "%-40s%lu allocated / %lu used / %lu free\n", "Slots:", stats.slotsAllocated, stats.slotsUsed, stats.slotsFree);
+    fprintf(out, "%-40s%lu size / %lu used / %lu holes (%.1f%%)\n", "Iterator:", stats.iteratorSize, stats.iteratorUsed,
+            stats.holes, stats.holeRatio * 100);
+    fprintf(out, "%-40s%lu touched / %lu reserved bytes\n", "Shared store:", stats.storeTouched, stats.storeReserved);
+    fprintf(out, "%-40s%lu bytes (+%lu allocator overhead)\n", "Bookkeeping:", stats.bookkeepingBytes, stats.allocatorOverhead);
+    fprintf(out, "%-40s%lu in use / %lu free bytes\n", "Process heap:", stats.heapInUse, stats.heapFree);
+    fprintf(out, "%-40s%lu records / %lu bytes\n", "Peak:", stats.peakRecords, stats.peakBytes);
+    fprintf(out, "\n");
     return true;
 }
 
+void getMemStats(t_mem_stats *stats){
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+
+    stats->liveRecords = (size_t)getEntryCount();
+    stats->recordBytes = sizeof(t_person);
+    stats->slotsAllocated = store->slotCount;
+    stats->slotsFree = (size_t)list.freeSlotCount;
+    stats->slotsUsed = stats->slotsAllocated - stats->slotsFree;
+    stats->iteratorSize = (size_t)list.size;
+    stats->iteratorUsed = (size_t)list.count;
+    stats->holes = (size_t)list.freed;
+    stats->holeRatio = list.count > 0 ? (double)list.freed / list.count : 0;
+    stats->storeReserved = sizeof(t_store) + STORE_MAX_RECORDS * sizeof(t_person);
+    stats->storeTouched = (sizeof(t_store) + store->slotCount * sizeof(t_person) + pageSize - 1) / pageSize * pageSize;
+
+    // heap blocks owned by the store: requested size vs. what the allocator keeps for them (+ chunk header)
+    struct { void *ptr; size_t requested; } blocks[] = {
+            {list.iterator, list.size * sizeof(t_slot)},
+            {list.freeSlots, list.freeSlotSize * sizeof(t_slot)},
+            {contest.contestants, contest.size * sizeof(t_contestant)},
+            {contest.dirty, contest.dirtySize * sizeof(t_slot)},
+    };
+    stats->bookkeepingBytes = stats->allocatorOverhead = 0;
+    for (size_t i = 0; i < sizeof(blocks) / sizeof(blocks[0]); ++i) {
+        if (blocks[i].ptr){
+            stats->bookkeepingBytes += blocks[i].requested;
+            stats->allocatorOverhead += malloc_usable_size(blocks[i].ptr) + sizeof(size_t) - blocks[i].requested;
+        }
+    }
+
+    struct mallinfo2 info = mallinfo2();
+    stats->heapInUse = info.uordblks + info.hblkhd;
+    stats->heapFree = info.fordblks;
+
+    trackPeakUsage();
+    stats->peakRecords = __atomic_load_n(&list.peakRecords, __ATOMIC_RELAXED);
+    stats->peakBytes = __atomic_load_n(&list.peakBytes, __ATOMIC_RELAXED);
+}
+
+void trackPeakUsage(void){
+    size_t records = (size_t)getEntryCount();
+    size_t bytes = sizeof(t_store) + store->slotCount * sizeof(t_person) + list.size * sizeof(t_slot) +
+                   list.freeSlotSize * sizeof(t_slot) + contest.size * sizeof(t_contestant) + contest.dirtySize * sizeof(t_slot);
+
+    raisePeak(&list.peakRecords, records);
+    raisePeak(&list.peakBytes, bytes);
+}
+
+void raisePeak(size_t *peak, size_t value){
+    size_t current = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while (current < value &&
+           !__atomic_compare_exchange_n(peak, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
 bool linkToFile(const char *filename){
     char fileNameBuffer[BUFFER_SIZE];
 
-    if (linkedFile.fp != NULL) {
+    if (isLinked()) {
         printf("Already linked to a file called: '%s'. Unlink from the file, and try again.\n", linkedFile.name);
     } else {
         const char *linkToName = filename;
@@ -565,16 +1107,37 @@ bool linkToFile(const char *filename){
             linkToName = fileNameBuffer;
         }
 
-        linkedFile.fp = fopen(linkToName, "ab+");
+        // a directory holds the records in shards, one file per area
+        struct stat info;
+        if (linkToName[strlen(linkToName) - 1] == '/' || (stat(linkToName, &info) == 0 && S_ISDIR(info.st_mode))) {
+            mkdir(linkToName, 0755); // it may exist already
+            linkedFile.dir = opendir(linkToName);
+        } else {
+            linkedFile.fp = fopen(linkToName, "ab+");
+        }
 
-        if (linkedFile.fp == NULL) {
+        if (!isLinked()) {
             fileError("Unable to link to file!");
             return false;
         } else {
             // change currently linked file name
             strncpy(linkedFile.name, linkToName, BUFFER_SIZE);
+            memset(linkedFile.dirtyShards, 0, sizeof(linkedFile.dirtyShards));
+            linkedFile.savedGeneration = 0;
+            linkedFile.tombstoneCount = 0;
+            if (!startPersister()) {
+                // nothing may be linked without the writer saving the edits
+                if (linkedFile.fp != NULL) fclose(linkedFile.fp);
+                if (linkedFile.dir != NULL) closedir(linkedFile.dir);
+                linkedFile.fp = NULL;
+                linkedFile.dir = NULL;
+                fprintf(stderr, "Unable to start the background writer, linking wasn't completed.\n");
+                return true;
+            }
 
-            if (getEntryCount() == 0){
+            if (linkedFile.dir != NULL && getEntryCount() == 0){
+                loadShards();
+            } else if (getEntryCount() == 0){
                 loadDataFromFile();
             } else {
                 // Ask whether to load data from file or dump current data into file.
@@ -582,13 +1145,19 @@ bool linkToFile(const char *filename){
                                            "\tIf 'yes' is selected current entries will be removed and the entries will be loaded from the file\n"
                                            "\tIf 'no' is selected the file will be emptied and the current entries will be saved in the file.\n"
                                            "Answer: ");
-                if (shouldLoad)
+                if (shouldLoad && linkedFile.dir != NULL)
+                    loadShards();
+                else if (shouldLoad)
                     loadDataFromFile();
                 else{
-                    fclose(linkedFile.fp);
-                    saveDataToFile();
+                    if (linkedFile.fp != NULL) fclose(linkedFile.fp);
+                    pthread_rwlock_wrlock(&storeLock);
+                    for (size_t i = 0; i < store->areaCount; ++i) markShardDirty((int)i);
+                    pthread_rwlock_unlock(&storeLock);
+                    scheduleSave();
                 }
             }
+            startWatcher();
         }
     }
 
@@ -596,11 +1165,32 @@ bool linkToFile(const char *filename){
 }
 
 bool unlinkFile(void){
+    stopWatcher();
+    stopPersister();
+    if (linkedFile.dir != NULL) closedir(linkedFile.dir);
     linkedFile.fp = NULL;
+    linkedFile.dir = NULL;
+
+    return true;
+}
+
+bool syncFile(FILE *out){
+    if (!isLinked()) {
+        fprintf(out, "The data store isn't linked to a file.\n");
+    } else {
+        if (waitForSave())
+            fprintf(out, "Every change is saved into '%s'.\n", linkedFile.name);
+        else
+            fprintf(out, "Unable to save the changes into '%s', they are tried again later.\n", linkedFile.name);
+    }
 
     return true;
 }
 
+bool isLinked(void){
+    return linkedFile.fp != NULL || linkedFile.dir != NULL;
+}
+
 bool askYesNo(const char *msg){
     char tmp[2];
     printf("%s", msg);
@@ -619,13 +1209,13 @@ bool manageAllocatedSpace(void){
     if (list.freed >= MANAGE_LIMIT){
         int emptyPos = 0;
         while (emptyPos < list.count){
-            if (!list.iterator[emptyPos]){
+            if (list.iterator[emptyPos] == NO_SLOT){
                 int nonEmptyPos = emptyPos + 1;
-                while (!list.iterator[nonEmptyPos] && nonEmptyPos < list.count) nonEmptyPos++;
+                while (nonEmptyPos < list.count && list.iterator[nonEmptyPos] == NO_SLOT) nonEmptyPos++;
                 if (nonEmptyPos >= list.count) break; /* Done. All position is empty. */
                 else {
                     list.iterator[emptyPos] = list.iterator[nonEmptyPos];
-                    list.iterator[nonEmptyPos] = NULL;
+                    list.iterator[nonEmptyPos] = NO_SLOT;
                 }
             } else  emptyPos++;
         }
@@ -638,7 +1228,7 @@ bool manageAllocatedSpace(void){
 }
 
 bool growIterator(int newSize){
-    t_person **tmp = (t_person **) realloc(list.iterator, newSize * sizeof(t_person *));
+    t_slot *tmp = (t_slot *) realloc(list.iterator, newSize * sizeof(t_slot));
     if (tmp) {
         list.iterator = tmp;
         list.size = newSize;
@@ -650,14 +1240,217 @@ bool growIterator(int newSize){
     }
 }
 
-void freeAllocated(void){
+bool createStore(const char *cataloguePath){
+    // used when there's no catalogue file
+    static const t_area catalogue[] = {{.name = "Barátfa", .inspector = 0}, {.name = "Lovas", .inspector = 0},
+                                       {.name = "Kígyós-patak", .inspector = 0}, {.name = "Káposztás kert", .inspector = 0},
+                                       {.name = "Szula", .inspector = 1}, {.name = "Malom telek", .inspector = 1},
+                                       {.name = "Páskom", .inspector = 1}};
+    static const size_t catalogueSize = sizeof(catalogue) / sizeof(catalogue[0]);
+
+    // reserve the space of every slot, the pages are only backed when they are touched
+    size_t length = sizeof(t_store) + STORE_MAX_RECORDS * sizeof(t_person);
+    store = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (store == MAP_FAILED) {
+        store = NULL;
+        noMemoryError();
+        return false;
+    }
+
+    if (loadAreaCatalogue(cataloguePath)) {
+        printf("%lu areas were loaded from '%s'.\n", store->areaCount, cataloguePath);
+    } else {
+        printf("Using the built-in areas, '%s' can't be read.\n", cataloguePath);
+        for (size_t i = 0; i < catalogueSize; ++i) {
+            store->areas[internArea(catalogue[i].name)].inspector = catalogue[i].inspector;
+        }
+    }
+
+    return true;
+}
+
+bool loadAreaCatalogue(const char *path){
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) return false;
+
+    char buffer[2 * BUFFER_SIZE];
+    char name[BUFFER_SIZE];
+    char inspector[BUFFER_SIZE];
+    char fmt[32];
+    fscanf(fp, "%*[^\n]\n"); /* ignore first line */
+
+    // read line by line, so a malformed line is reported and the rest of the file is still read
+    sprintf(fmt, "%%%d[^;];%%%d[^;\n]", BUFFER_SIZE - 1, 5);
+    int line = 1;
+    while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+        line++;
+        size_t length = strcspn(buffer, "\r\n");
+        if (buffer[length] == '\0' && !feof(fp)) {
+            fscanf(fp, "%*[^\n]"); // the rest of the overlong line
+            fgetc(fp);
+            fprintf(stderr, "%s:%d: the line is too long, it is skipped.\n", path, line);
+            continue;
+        }
+        buffer[length] = '\0';
+        if (length == 0) continue;
+        if (sscanf(buffer, fmt, name, inspector) != 2) {
+            fprintf(stderr, "%s:%d: '%s' is skipped, the lines are expected as 'Area;Inspector'.\n", path, line, buffer);
+            continue;
+        }
+
+        int id = atoi(inspector);
+        int area = id < 1 || id > PROC_MAX ? -1 : internArea(name);
+        if (area < 0) {
+            fprintf(stderr, "%s:%d: '%s' is skipped, inspectors are numbered from 1 to %d and there can be %d areas.\n",
+                    path, line, name, PROC_MAX, AREA_MAX);
+            continue;
+        }
+        store->areas[area].inspector = id - 1;
+    }
+
+    fclose(fp);
+    return store->areaCount > 0;
+}
+
+t_slot allocRecord(void){
+    if (list.freeSlotCount > 0)
+        return list.freeSlots[--list.freeSlotCount];
+    if (store->slotCount >= STORE_MAX_RECORDS)
+        return NO_SLOT;
+    return (t_slot)store->slotCount++;
+}
+
+void unallocRecord(t_slot slot){
+    if ((size_t)slot == store->slotCount - 1)
+        store->slotCount--;
+    else
+        list.freeSlots[list.freeSlotCount++] = slot; // it was taken from there, so there's room for it
+}
+
+bool freeRecord(t_slot slot){
+    // the memory is taken first, so nothing is changed when it runs out
+    if (list.freeSlotCount == list.freeSlotSize){
+        int newSize = list.freeSlotSize + GROW_BY;
+        t_slot *tmp = (t_slot *) realloc(list.freeSlots, newSize * sizeof(t_slot));
+        if (!tmp) {
+            noMemoryError();
+            return false;
+        }
+        list.freeSlots = tmp;
+        list.freeSlotSize = newSize;
+    }
+    if (!markDirty(slot)) return false;
+
+    store->slots[slot].version = 0;
+    list.freeSlots[list.freeSlotCount++] = slot;
+    return true;
+}
+
+bool touchRecord(t_slot slot){
+    // a record is changed only if the contest knows about it, judgeContest reads the contestant of every record
+    if (!markDirty(slot)) return false;
+    store->slots[slot].version = ++store->generation;
+    return true;
+}
+
+bool markDirty(t_slot slot){
+    if ((size_t)slot >= contest.size){
+        size_t newSize = contest.size * 2 > (size_t)slot ? contest.size * 2 : (size_t)slot + 1;
+        t_contestant *tmp = (t_contestant *) realloc(contest.contestants, newSize * sizeof(t_contestant));
+        if (!tmp) {
+            noMemoryError();
+            return false;
+        }
+        memset(tmp + contest.size, 0, (newSize - contest.size) * sizeof(t_contestant));
+        contest.contestants = tmp;
+        contest.size = newSize;
+    }
+
+    if (!contest.contestants[slot].dirty){
+        if (contest.dirtyCount == contest.dirtySize){
+            size_t newSize = contest.dirtySize * 2 + INIT_SIZE;
+            t_slot *tmp = (t_slot *) realloc(contest.dirty, newSize * sizeof(t_slot));
+            if (!tmp) {
+                noMemoryError();
+                return false;
+            }
+            contest.dirty = tmp;
+            contest.dirtySize = newSize;
+        }
+        contest.dirty[contest.dirtyCount++] = slot;
+        contest.contestants[slot].dirty = true;
+    }
+
+    return true;
+}
+
+t_person *recordAt(int i){
+    return list.iterator[i] == NO_SLOT ? NULL : &store->slots[list.iterator[i]];
+}
+
+int findRecord(const char *name){
     for (int i = 0; i < list.count; ++i) {
-        free(list.iterator[i]);
+        t_person *record = recordAt(i);
+        if (record && strcmp(name, record->name) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+int findArea(const char *name){
+    // linear probing, the table is never more than half full
+    unsigned hash = hashName(name);
+    for (unsigned i = hash & (AREA_INDEX_SIZE - 1); store->areaIndex[i] != 0; i = (i + 1) & (AREA_INDEX_SIZE - 1)) {
+        t_area *area = &store->areas[store->areaIndex[i] - 1];
+        if (area->hash == hash && strcmp(name, area->name) == 0){
+            return store->areaIndex[i] - 1;
+        }
+    }
+
+    return -1;
+}
+
+int internArea(const char *name){
+    int area = findArea(name);
+    if (area < 0 && store->areaCount < AREA_MAX){
+        area = (int)store->areaCount++;
+        strncpy(store->areas[area].name, name, BUFFER_SIZE);
+        store->areas[area].inspector = -1;
+        store->areas[area].hash = hashName(name);
+
+        unsigned i = store->areas[area].hash & (AREA_INDEX_SIZE - 1);
+        while (store->areaIndex[i] != 0) i = (i + 1) & (AREA_INDEX_SIZE - 1);
+        store->areaIndex[i] = area + 1;
     }
+
+    return area;
+}
+
+void freeAllocated(void){
     free(list.iterator);
+    free(list.freeSlots);
+    list.iterator = list.freeSlots = NULL;
+    free(contest.contestants);
+    free(contest.dirty);
+    contest.contestants = NULL;
+    contest.dirty = NULL;
+    contest.size = contest.dirtySize = contest.dirtyCount = 0;
+    list.size = list.count = list.freed = list.freeSlotSize = list.freeSlotCount = 0;
+    free(linkedFile.tombstones);
+    linkedFile.tombstones = NULL;
+    linkedFile.tombstoneCount = linkedFile.tombstoneSize = 0;
+
+    if (store){
+        munmap(store, sizeof(t_store) + STORE_MAX_RECORDS * sizeof(t_person));
+        store = NULL;
+    }
 }
 
 bool exitExecution(void){
+    stopWatcher();
+    stopPersister();
+    stopContestEngine();
     freeAllocated();
     return true;
 }
@@ -669,7 +1462,13 @@ int getEntryCount(void) {
 /* TODO: verify data loaded from file */
 void loadDataFromFile(void){
     if (linkedFile.fp != NULL){
-        removeAllRecord();
+        pthread_rwlock_wrlock(&storeLock);
+        if (!removeAllRecord()) {
+            fprintf(stderr, "Out of memory, the file isn't loaded.\n");
+            fclose(linkedFile.fp);
+            pthread_rwlock_unlock(&storeLock);
+            return;
+        }
 
         /* Read data */
         char buffer1[BUFFER_SIZE];
@@ -681,46 +1480,1125 @@ void loadDataFromFile(void){
 
         sprintf(fmt, "%%%d[^;];%%%d[^;];%%%d[^;\n]\n", BUFFER_SIZE - 1, BUFFER_SIZE - 1, 5);
         while (fscanf(linkedFile.fp, fmt, buffer1, buffer2, buffer3) != EOF) {
-            t_person *newRecord = (t_person *) malloc(sizeof(t_person));
-            if (!newRecord) noMemoryError();
+            int area = internArea(buffer2); // unknown areas are kept, so saving won't lose them
+            if (area < 0) {
+                fprintf(stderr, "Too many areas, the record of '%s' is ignored.\n", buffer1);
+                continue;
+            }
+            t_slot slot = allocRecord();
+            if (slot == NO_SLOT) {
+                fprintf(stderr, "The data store is full, the rest of the file is ignored.\n");
+                break;
+            }
+            if (!touchRecord(slot)) {
+                unallocRecord(slot);
+                fprintf(stderr, "Out of memory, the rest of the file is ignored.\n");
+                break;
+            }
 
+            t_person *newRecord = &store->slots[slot];
             strncpy(newRecord->name, buffer1, BUFFER_SIZE);
-            strncpy(newRecord->area, buffer2, BUFFER_SIZE);
+            newRecord->area = area;
             newRecord->applicationCount = atoi(buffer3);
 
-            appendRecord(newRecord);
+            appendRecord(slot);
         }
         fclose(linkedFile.fp);
+        advanceSavedGeneration(store->generation); // the file holds every record
+        pthread_rwlock_unlock(&storeLock);
     }
 }
 
-void saveDataToFile(void){
-    if (linkedFile.fp != NULL){
-        reopenFile();
-        fprintf(linkedFile.fp, "Name;Area;Application Count\n");
-        for (int i = 0; i < list.count; ++i) {
-            if (list.iterator[i]) {
-                fprintf(linkedFile.fp, "%s;", list.iterator[i]->name);
-                fprintf(linkedFile.fp, "%s;", list.iterator[i]->area);
-                fprintf(linkedFile.fp, "%d", list.iterator[i]->applicationCount);
-                fprintf(linkedFile.fp, "\n");
+void loadShards(void){
+    t_shard_queue queue = {NULL, 0, 0};
+    size_t size = 0;
+    struct dirent *entry;
+
+    // every .csv file of the directory is a shard
+    rewinddir(linkedFile.dir);
+    while ((entry = readdir(linkedFile.dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length <= 4 || strcmp(entry->d_name + length - 4, ".csv") != 0) continue;
+
+        if (queue.count == size) {
+            size_t newSize = size * 2 + INIT_SIZE;
+            t_shard *tmp = (t_shard *) realloc(queue.shards, newSize * sizeof(t_shard));
+            if (!tmp) {
+                noMemoryError();
+                break;
             }
+            queue.shards = tmp;
+            size = newSize;
         }
-        fclose(linkedFile.fp);
+        t_shard *shard = &queue.shards[queue.count++];
+        memset(shard, 0, sizeof(t_shard));
+        snprintf(shard->path, PATH_SIZE, "%s/%s", linkedFile.name, entry->d_name);
     }
-}
-
-void appendRecord(t_person *newRecord) {
-    list.iterator[list.count++] = newRecord;
-    if (list.count >= list.size) growIterator(list.size + GROW_BY);
-}
 
-void removeAllRecord(void) {
+    // the files are read in parallel, but only this thread touches the store
+    runShardWorkers(shardLoader, &queue);
+
+    pthread_rwlock_wrlock(&storeLock);
+    bool full = !removeAllRecord(), moved = false;
+    if (full) fprintf(stderr, "Out of memory, the shards aren't loaded.\n");
+    for (size_t i = 0; i < queue.count; ++i) {
+        t_shard *shard = &queue.shards[i];
+        if (shard->failed)
+            fprintf(stderr, "Unable to read every record of '%s'.\n", shard->path);
+
+        for (size_t j = 0; j < shard->rowCount && !full; ++j) {
+            t_row *row = &shard->rows[j];
+            int area = internArea(row->area); // unknown areas are kept, so saving won't lose them
+            if (area < 0) {
+                fprintf(stderr, "Too many areas, the record of '%s' is ignored.\n", row->name);
+                continue;
+            }
+            t_slot slot = allocRecord();
+            if (slot == NO_SLOT || !touchRecord(slot)) {
+                if (slot != NO_SLOT) unallocRecord(slot);
+                fprintf(stderr, "%s, the rest of the shards are ignored.\n", slot == NO_SLOT ? "The data store is full" : "Out of memory");
+                full = true;
+                break;
+            }
+
+            t_person *newRecord = &store->slots[slot];
+            strncpy(newRecord->name, row->name, BUFFER_SIZE);
+            newRecord->area = area;
+            newRecord->applicationCount = row->applicationCount;
+            appendRecord(slot);
+            if (shard->misplaced) markShardDirty(area);
+        }
+
+        if (full) shard->misplaced = false; // not every record of it is in the store, so the file stays
+        moved = moved || shard->misplaced;
+        free(shard->rows);
+    }
+    advanceSavedGeneration(store->generation); // the shards hold every record
+    pthread_rwlock_unlock(&storeLock);
+
+    // the records of other areas are moved into their own shards, the old file is only set aside once they're written
+    if (moved && saveShards()) {
+        for (size_t i = 0; i < queue.count; ++i) {
+            char mergedName[PATH_SIZE + 8];
+            sprintf(mergedName, "%s.merged", queue.shards[i].path);
+            if (!queue.shards[i].misplaced) continue;
+            if (queue.shards[i].own || rename(queue.shards[i].path, mergedName) == 0)
+                printf("'%s' held records of other areas, they are moved into their own files.\n", queue.shards[i].path);
+        }
+    } else if (moved) {
+        fprintf(stderr, "Unable to move the records of other areas into their own files, the files are kept as they are.\n");
+        scheduleSave();
+    }
+    free(queue.shards);
+}
+
+bool saveDataToFile(const char *path, const char *content, size_t length){
+    // write into a temp file first, so a crash can't leave the linked file half-written
+    char tmpName[PATH_SIZE + 8];
+    sprintf(tmpName, "%s.tmp", path);
+
+    int fd = open(tmpName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return false;
+
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = write(fd, content + done, length - done);
+        if (n <= 0) break;
+        done += n;
+    }
+
+    bool written = (done == length && fsync(fd) == 0);
+    struct stat info;
+    if (written && fstat(fd, &info) == 0)
+        noteOwnWrite(&info); // the rename keeps the inode, so the watcher will know the file
+    if (close(fd) != 0 || !written || rename(tmpName, path) != 0) {
+        unlink(tmpName);
+        return false;
+    }
+
+    // make the rename itself durable
+    char dirName[PATH_SIZE];
+    snprintf(dirName, PATH_SIZE, "%s", path);
+    int dir_fd = open(dirname(dirName), O_RDONLY | O_DIRECTORY);
+    if (dir_fd != -1) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+
+    return true;
+}
+
+char *serializeRecords(size_t *length){
+    char *content = NULL;
+    FILE *fp = open_memstream(&content, length);
+    if (fp == NULL)
+        return NULL;
+
+    fprintf(fp, "Name;Area;Application Count\n");
+    for (int i = 0; i < list.count; ++i) {
+        t_person *record = recordAt(i);
+        if (record) {
+            fprintf(fp, "%s;", record->name);
+            fprintf(fp, "%s;", store->areas[record->area].name);
+            fprintf(fp, "%d", record->applicationCount);
+            fprintf(fp, "\n");
+        }
+    }
+    fclose(fp);
+
+    return content;
+}
+
+bool saveShards(void){
+    FILE *streams[AREA_MAX] = {NULL};
+    t_shard_queue queue = {NULL, 0, 0};
+    bool saved = true;
+
+    // take a snapshot of the changed areas with a single pass over the records
+    pthread_rwlock_rdlock(&storeLock);
+    queue.shards = (t_shard *) calloc(store->areaCount + 1, sizeof(t_shard));
+    if (queue.shards == NULL) {
+        pthread_rwlock_unlock(&storeLock);
+        return false;
+    }
+    for (size_t area = 0; area < store->areaCount; ++area) {
+        if (!linkedFile.dirtyShards[area]) continue;
+        linkedFile.dirtyShards[area] = false;
+
+        t_shard *shard = &queue.shards[queue.count++];
+        shard->area = (int)area;
+        shardPath(shard->path, store->areas[area].name);
+        streams[area] = open_memstream(&shard->content, &shard->length);
+        if (streams[area] != NULL)
+            fprintf(streams[area], "Name;Area;Application Count\n");
+    }
+    for (int i = 0; queue.count > 0 && i < list.count; ++i) {
+        t_person *record = recordAt(i);
+        if (record && streams[record->area]) {
+            fprintf(streams[record->area], "%s;", record->name);
+            fprintf(streams[record->area], "%s;", store->areas[record->area].name);
+            fprintf(streams[record->area], "%d", record->applicationCount);
+            fprintf(streams[record->area], "\n");
+        }
+    }
+    for (size_t area = 0; area < store->areaCount; ++area) {
+        if (streams[area]) fclose(streams[area]);
+    }
+    persister.snapshot = store->generation;
+    pthread_rwlock_unlock(&storeLock);
+
+    // the disk is written without holding the store
+    runShardWorkers(shardSaver, &queue);
+
+    for (size_t i = 0; i < queue.count; ++i) {
+        if (queue.shards[i].failed) {
+            // the writer keeps the edits pending and tries the shard again after the next interval
+            pthread_rwlock_wrlock(&storeLock);
+            markShardDirty(queue.shards[i].area);
+            pthread_rwlock_unlock(&storeLock);
+            saved = false;
+        }
+        free(queue.shards[i].content);
+    }
+    free(queue.shards);
+
+    return saved;
+}
+
+void markShardDirty(int area){
+    if (area >= 0 && area < AREA_MAX)
+        linkedFile.dirtyShards[area] = true;
+}
+
+void advanceSavedGeneration(unsigned long generation){
+    unsigned long current = __atomic_load_n(&linkedFile.savedGeneration, __ATOMIC_ACQUIRE);
+    while (current < generation &&
+           !__atomic_compare_exchange_n(&linkedFile.savedGeneration, &current, generation, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
+
+bool reserveTombstone(void){
+    if (!isLinked() || linkedFile.tombstoneCount < linkedFile.tombstoneSize) return true;
+
+    size_t newSize = linkedFile.tombstoneSize * 2 + INIT_SIZE;
+    t_tombstone *tmp = (t_tombstone *) realloc(linkedFile.tombstones, newSize * sizeof(t_tombstone));
+    if (!tmp) {
+        noMemoryError();
+        return false;
+    }
+    linkedFile.tombstones = tmp;
+    linkedFile.tombstoneSize = newSize;
+    return true;
+}
+
+void addTombstone(const char *name, unsigned long generation){
+    if (!isLinked()) return; // nothing can bring it back
+    t_tombstone *tombstone = &linkedFile.tombstones[linkedFile.tombstoneCount++];
+    strncpy(tombstone->name, name, BUFFER_SIZE - 1);
+    tombstone->name[BUFFER_SIZE - 1] = '\0';
+    tombstone->generation = generation;
+}
+
+bool isTombstone(const char *name){
+    for (size_t i = 0; i < linkedFile.tombstoneCount; ++i) {
+        if (strcmp(linkedFile.tombstones[i].name, name) == 0) return true;
+    }
+    return false;
+}
+
+void dropSavedTombstones(void){
+    unsigned long saved = __atomic_load_n(&linkedFile.savedGeneration, __ATOMIC_ACQUIRE);
+    size_t kept = 0;
+    for (size_t i = 0; i < linkedFile.tombstoneCount; ++i) {
+        if (linkedFile.tombstones[i].generation > saved)
+            linkedFile.tombstones[kept++] = linkedFile.tombstones[i];
+    }
+    linkedFile.tombstoneCount = kept;
+}
+
+void shardPath(char *path, const char *area){
+    int length = snprintf(path, PATH_SIZE, "%s/", linkedFile.name);
+    for (; *area && length < PATH_SIZE - 5; ++area)
+        path[length++] = *area == '/' ? '_' : *area; // '/' can't be a part of a file name
+    strcpy(path + length, ".csv");
+}
+
+void runShardWorkers(void *(*worker)(void *), t_shard_queue *queue){
+    pthread_t threads[SHARD_WORKERS];
+    size_t started = 0;
+
+    queue->next = 0;
+    while (started < SHARD_WORKERS && started < queue->count &&
+           pthread_create(&threads[started], NULL, worker, queue) == 0)
+        started++;
+    if (started == 0) worker(queue); // no thread could be started, do the work here
+
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+void *shardLoader(void *args){
+    t_shard_queue *queue = args;
+    char buffer[3 * BUFFER_SIZE];
+    char countBuffer[BUFFER_SIZE];
+    char expected[PATH_SIZE];
+    char fmt[32];
+    size_t i;
+
+    sprintf(fmt, "%%%d[^;];%%%d[^;];%%%d[^;\n]", BUFFER_SIZE - 1, BUFFER_SIZE - 1, 5);
+    while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->count) {
+        t_shard *shard = &queue->shards[i];
+        FILE *fp = fopen(shard->path, "r");
+        if (fp == NULL) {
+            shard->failed = true;
+            continue;
+        }
+
+        t_row row;
+        fscanf(fp, "%*[^\n]\n"); /* ignore first line */
+
+        // a malformed line is reported and skipped like in the catalogue, the rest of the shard is still read
+        int line = 1;
+        while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+            line++;
+            size_t length = strcspn(buffer, "\r\n");
+            if (buffer[length] == '\0' && !feof(fp)) {
+                fscanf(fp, "%*[^\n]"); // the rest of the overlong line
+                fgetc(fp);
+                fprintf(stderr, "%s:%d: the line is too long, it is skipped.\n", shard->path, line);
+                continue;
+            }
+            buffer[length] = '\0';
+            if (length == 0) continue;
+            if (sscanf(buffer, fmt, row.name, row.area, countBuffer) != 3) {
+                fprintf(stderr, "%s:%d: '%s' is skipped, the lines are expected as 'Name;Area;Count'.\n",
+                        shard->path, line, buffer);
+                continue;
+            }
+
+            if (shard->rowCount == shard->rowSize) {
+                size_t newSize = shard->rowSize * 2 + INIT_SIZE;
+                t_row *tmp = (t_row *) realloc(shard->rows, newSize * sizeof(t_row));
+                if (!tmp) {
+                    shard->failed = true;
+                    break;
+                }
+                shard->rows = tmp;
+                shard->rowSize = newSize;
+            }
+            row.applicationCount = atoi(countBuffer);
+            shardPath(expected, row.area);
+            if (strcmp(expected, shard->path) != 0) shard->misplaced = true;
+            else shard->own = true;
+            shard->rows[shard->rowCount++] = row;
+        }
+        fclose(fp);
+    }
+
+    return NULL;
+}
+
+void *shardSaver(void *args){
+    t_shard_queue *queue = args;
+    size_t i;
+
+    while ((i = __atomic_fetch_add(&queue->next, 1, __ATOMIC_RELAXED)) < queue->count) {
+        t_shard *shard = &queue->shards[i];
+        if (shard->content == NULL || !saveDataToFile(shard->path, shard->content, shard->length))
+            shard->failed = true;
+    }
+
+    return NULL;
+}
+
+void scheduleSave(void){
+    if (isLinked()){
+        pthread_mutex_lock(&persister.mutex);
+        persister.requested++;
+        pthread_cond_signal(&persister.changed);
+        pthread_mutex_unlock(&persister.mutex);
+    }
+}
+
+bool waitForSave(void){
+    pthread_mutex_lock(&persister.mutex);
+    unsigned long target = persister.requested, attempts = persister.attempts;
+    // a failure reported before this call doesn't count, the next try may succeed
+    while (persister.running && persister.written < target && !(persister.failed && persister.attempts > attempts))
+        pthread_cond_wait(&persister.saved, &persister.mutex);
+    bool saved = persister.written >= target;
+    pthread_mutex_unlock(&persister.mutex);
+
+    return saved;
+}
+
+bool startPersister(void){
+    if (!persister.running){
+        persister.running = true;
+        persister.requested = persister.written = persister.attempts = 0;
+        persister.failed = false;
+        if (pthread_create(&persister.thread, NULL, persisterMain, NULL) != 0){
+            persister.running = false;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void stopPersister(void){
+    if (persister.running){
+        pthread_mutex_lock(&persister.mutex);
+        persister.running = false; // the writer still saves the pending edits before it stops
+        pthread_cond_signal(&persister.changed);
+        pthread_mutex_unlock(&persister.mutex);
+
+        pthread_join(persister.thread, NULL);
+    }
+}
+
+void *persisterMain(void *args){
+    (void)args;
+    // the signals are left to the main thread
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    pthread_mutex_lock(&persister.mutex);
+    while (persister.running || persister.written < persister.requested){
+        if (persister.written == persister.requested){
+            pthread_cond_wait(&persister.changed, &persister.mutex);
+            continue;
+        }
+
+        // group commit: let the edits of the following interval join this save
+        if (persister.running){
+            pthread_mutex_unlock(&persister.mutex);
+            struct timespec interval = {0, COMMIT_INTERVAL_MS * 1000000L};
+            nanosleep(&interval, NULL);
+            pthread_mutex_lock(&persister.mutex);
+        }
+        unsigned long generation = persister.requested;
+        pthread_mutex_unlock(&persister.mutex);
+
+        bool saved;
+        if (linkedFile.dir != NULL) {
+            saved = saveShards();
+        } else {
+            // take a snapshot of the records, the disk is written without holding the store
+            size_t length;
+            pthread_rwlock_rdlock(&storeLock);
+            char *content = serializeRecords(&length);
+            persister.snapshot = store->generation;
+            pthread_rwlock_unlock(&storeLock);
+
+            saved = content != NULL && saveDataToFile(linkedFile.name, content, length);
+            free(content);
+        }
+        if (saved) {
+            advanceSavedGeneration(persister.snapshot); // the watcher may have moved it past this snapshot meanwhile
+            pthread_rwlock_wrlock(&storeLock);
+            dropSavedTombstones();
+            pthread_rwlock_unlock(&storeLock);
+        }
+
+        pthread_mutex_lock(&persister.mutex);
+        persister.attempts++;
+        if (saved) {
+            persister.written = generation;
+            persister.failed = false;
+        } else {
+            // the edits stay pending and are tried again after the next interval, the error is reported once
+            if (!persister.failed)
+                fprintf(stderr, "%s: %s\n", "File error: ", "Unable to save into the linked file, trying again!");
+            persister.failed = true;
+        }
+        pthread_cond_broadcast(&persister.saved);
+
+        if (!saved && !persister.running) {
+            fprintf(stderr, "%s: %s\n", "File error: ", "The last edits couldn't be saved into the linked file!");
+            break;
+        }
+    }
+    pthread_mutex_unlock(&persister.mutex);
+
+    return NULL;
+}
+
+void startWatcher(void){
+    // the saves replace the file by a rename, so its directory is watched
+    char dirName[BUFFER_SIZE];
+    strncpy(dirName, linkedFile.name, BUFFER_SIZE);
+    const char *watched = linkedFile.dir != NULL ? linkedFile.name : dirname(dirName);
+
+    watcher.inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (watcher.inotify_fd == -1 || inotify_add_watch(watcher.inotify_fd, watched, IN_CLOSE_WRITE | IN_MOVED_TO) == -1 ||
+        pipe(watcher.stop_fds) == -1) {
+        fprintf(stderr, "Unable to watch '%s', the changes of other programs won't be loaded.\n", watched);
+        if (watcher.inotify_fd != -1) close(watcher.inotify_fd);
+        return;
+    }
+
+    watcher.running = pthread_create(&watcher.thread, NULL, watcherMain, NULL) == 0;
+    if (!watcher.running) {
+        close(watcher.inotify_fd);
+        close(watcher.stop_fds[0]);
+        close(watcher.stop_fds[1]);
+    }
+}
+
+void stopWatcher(void){
+    if (watcher.running){
+        // the inspectors forked meanwhile hold the pipe too, so closing it wouldn't wake the watcher
+        write(watcher.stop_fds[1], "", 1);
+        pthread_join(watcher.thread, NULL);
+        close(watcher.stop_fds[0]);
+        close(watcher.stop_fds[1]);
+        close(watcher.inotify_fd);
+        watcher.running = false;
+    }
+}
+
+void *watcherMain(void *args){
+    (void)args;
+    // the signals are left to the main thread
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    const char *baseName = strrchr(linkedFile.name, '/') ? strrchr(linkedFile.name, '/') + 1 : linkedFile.name;
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct pollfd fds[2] = {{watcher.inotify_fd, POLLIN, 0}, {watcher.stop_fds[0], POLLIN, 0}};
+
+    while (poll(fds, 2, -1) >= 0 && fds[1].revents == 0) {
+        ssize_t length = read(watcher.inotify_fd, buffer, sizeof(buffer));
+        char previous[NAME_MAX + 1] = "";
+
+        for (char *ptr = buffer; ptr < buffer + length; ptr += sizeof(struct inotify_event) + ((struct inotify_event *) ptr)->len) {
+            const struct inotify_event *event = (const struct inotify_event *) ptr;
+            size_t nameLength = event->len ? strlen(event->name) : 0;
+            bool watched = linkedFile.dir != NULL ? nameLength > 4 && strcmp(event->name + nameLength - 4, ".csv") == 0
+                                                  : nameLength > 0 && strcmp(event->name, baseName) == 0;
+            if (!watched || strcmp(event->name, previous) == 0) continue; // a file is diffed once for a batch of events
+            strncpy(previous, event->name, NAME_MAX);
+
+            char path[PATH_SIZE];
+            if (linkedFile.dir != NULL)
+                snprintf(path, PATH_SIZE, "%s/%s", linkedFile.name, event->name);
+            else
+                strncpy(path, linkedFile.name, PATH_SIZE);
+            applyFileChanges(path);
+        }
+    }
+
+    return NULL;
+}
+
+void noteOwnWrite(const struct stat *info){
+    pthread_mutex_lock(&watcher.mutex);
+    watcher.ownWrites[watcher.ownWriteCount++ % OWN_WRITES_MAX] =
+            (t_file_id){info->st_dev, info->st_ino, info->st_size, info->st_mtim};
+    pthread_mutex_unlock(&watcher.mutex);
+}
+
+bool isOwnWrite(const struct stat *info){
+    bool found = false;
+    pthread_mutex_lock(&watcher.mutex);
+    size_t count = watcher.ownWriteCount < OWN_WRITES_MAX ? watcher.ownWriteCount : OWN_WRITES_MAX;
+    for (size_t i = 0; i < count && !found; ++i) {
+        t_file_id *id = &watcher.ownWrites[i];
+        found = id->dev == info->st_dev && id->ino == info->st_ino && id->size == info->st_size &&
+                id->mtime.tv_sec == info->st_mtim.tv_sec && id->mtime.tv_nsec == info->st_mtim.tv_nsec;
+    }
+    pthread_mutex_unlock(&watcher.mutex);
+
+    return found;
+}
+
+void applyFileChanges(const char *path){
+    struct stat info;
+    if (stat(path, &info) != 0 || isOwnWrite(&info)) return;
+
+    // the file is read without holding the store
+    t_shard shard = {0};
+    strncpy(shard.path, path, PATH_SIZE - 1);
+    t_shard_queue queue = {&shard, 1, 0};
+    shardLoader(&queue);
+    if (shard.failed) {
+        fprintf(stderr, "Unable to read the changes of '%s'.\n", path);
+        free(shard.rows);
+        return;
+    }
+
+    // index the rows by name, so every record is looked up once
+    size_t indexSize = 16;
+    while (indexSize < shard.rowCount * 2) indexSize *= 2;
+    size_t *index = (size_t *) calloc(indexSize, sizeof(size_t)); /* row + 1, 0 if the slot is empty */
+    bool *seen = (bool *) calloc(shard.rowCount + 1, sizeof(bool));
+    if (!index || !seen) {
+        fprintf(stderr, "Out of memory, the changes of '%s' aren't loaded.\n", path);
+        free(index);
+        free(seen);
+        free(shard.rows);
+        return;
+    }
+    for (size_t i = 0; i < shard.rowCount; ++i) {
+        index[findRowSlot(index, indexSize, shard.rows, shard.rows[i].name)] = i + 1; // a repeated name takes its last line
+    }
+
+    pthread_rwlock_wrlock(&storeLock);
+    unsigned long saved = __atomic_load_n(&linkedFile.savedGeneration, __ATOMIC_ACQUIRE);
+    unsigned long before = store->generation;
+    int added = 0, changed = 0, removed = 0;
+    bool moved = false, outOfMemory = false;
+
+    // a shard holds the records of its own area, the linked file holds every record
+    bool inFile[AREA_MAX];
+    for (size_t i = 0; i < shard.rowCount; ++i) {
+        internArea(shard.rows[i].area); // unknown areas are kept, so saving won't lose them
+    }
+    for (size_t area = 0; area < store->areaCount; ++area) {
+        char expected[PATH_SIZE];
+        shardPath(expected, store->areas[area].name);
+        inFile[area] = linkedFile.dir == NULL || strcmp(expected, path) == 0;
+    }
+
+    // the records of the other shards are indexed by name, a line may have moved one of them here
+    size_t recordIndexSize = 16;
+    size_t *recordIndex = NULL; /* position + 1, 0 if the slot is empty */
+    if (linkedFile.dir != NULL) {
+        while (recordIndexSize < (size_t)list.count * 2) recordIndexSize *= 2;
+        recordIndex = (size_t *) calloc(recordIndexSize, sizeof(size_t));
+        outOfMemory = recordIndex == NULL;
+    }
+
+    for (int i = 0; i < list.count && !outOfMemory; ++i) {
+        t_person *record = recordAt(i);
+        if (!record) continue;
+        if (!inFile[record->area]) {
+            if (recordIndex) recordIndex[findRecordSlot(recordIndex, recordIndexSize, record->name)] = i + 1;
+            continue;
+        }
+
+        size_t j = findRowSlot(index, indexSize, shard.rows, record->name);
+        if (index[j] != 0) seen[index[j] - 1] = true;
+        if (record->version > saved) continue; // edited here since the last save, the edit is kept
+
+        if (index[j] == 0) {
+            if (!freeRecord(list.iterator[i])) {
+                outOfMemory = true;
+                break;
+            }
+            list.iterator[i] = NO_SLOT;
+            list.freed++;
+            removed++;
+            continue;
+        }
+
+        t_row *row = &shard.rows[index[j] - 1];
+        int area = findArea(row->area);
+        if (area >= 0 && (area != record->area || row->applicationCount != record->applicationCount)) {
+            if (!touchRecord(list.iterator[i])) {
+                outOfMemory = true;
+                break;
+            }
+            if (!inFile[area]) {
+                markShardDirty(area); // moved into another shard
+                moved = true;
+            }
+            record->area = area;
+            record->applicationCount = row->applicationCount;
+            changed++;
+        }
+    }
+
+    // the rest of the lines are new records, or records moved here from another shard
+    for (size_t i = 0; i < shard.rowCount && !outOfMemory; ++i) {
+        t_row *row = &shard.rows[i];
+        int area = findArea(row->area);
+        if (seen[i] || area < 0 || index[findRowSlot(index, indexSize, shard.rows, row->name)] != i + 1)
+            continue; // already diffed, or a repeated name
+
+        int existing = -1;
+        if (recordIndex) {
+            size_t j = findRecordSlot(recordIndex, recordIndexSize, row->name);
+            existing = (int)recordIndex[j] - 1;
+        }
+        if (existing < 0 && isTombstone(row->name))
+            continue; // removed or renamed here, the file was saved before that
+        if (existing >= 0) {
+            t_person *record = recordAt(existing);
+            if (record->version > saved) continue;
+            if (!touchRecord(list.iterator[existing])) {
+                outOfMemory = true;
+                break;
+            }
+            markShardDirty(record->area); // its previous shard drops it
+            record->area = area;
+            record->applicationCount = row->applicationCount;
+            changed++;
+        } else {
+            t_slot slot = allocRecord();
+            if (slot == NO_SLOT) {
+                fprintf(stderr, "The data store is full, the rest of '%s' is ignored.\n", path);
+                break;
+            }
+            if (!touchRecord(slot)) {
+                unallocRecord(slot);
+                outOfMemory = true;
+                break;
+            }
+            t_person *newRecord = &store->slots[slot];
+            strncpy(newRecord->name, row->name, BUFFER_SIZE);
+            newRecord->area = area;
+            newRecord->applicationCount = row->applicationCount;
+            appendRecord(slot);
+            added++;
+        }
+        if (!inFile[area]) markShardDirty(area); // a line of another area
+        moved |= existing >= 0 || !inFile[area];
+    }
+
+    // the records of other shards are saved into their own shards, and this one is rewritten without them
+    if (moved) {
+        for (size_t area = 0; area < store->areaCount; ++area) {
+            if (inFile[area]) markShardDirty((int)area);
+        }
+    }
+    if (removed > 0) manageAllocatedSpace();
+
+    // a save in flight took its snapshot before these changes, so it would overwrite them in the file: save once more after it
+    pthread_mutex_lock(&persister.mutex);
+    bool resave = persister.written < persister.requested && store->generation != before;
+    pthread_mutex_unlock(&persister.mutex);
+    if (resave) {
+        for (size_t area = 0; area < store->areaCount; ++area) {
+            if (inFile[area]) markShardDirty((int)area);
+        }
+    } else if (saved == before) {
+        advanceSavedGeneration(store->generation); // the store matches the files again
+        dropSavedTombstones();
+    }
+    pthread_rwlock_unlock(&storeLock);
+
+    if (moved || resave) scheduleSave();
+    if (outOfMemory)
+        fprintf(stderr, "Out of memory, the rest of the changes of '%s' are ignored.\n", path);
+    if (added + changed + removed > 0)
+        printf("'%s' was changed by another program: %d added, %d changed, %d removed.\n", path, added, changed, removed);
+    fflush(stdout);
+
+    free(recordIndex);
+    free(index);
+    free(seen);
+    free(shard.rows);
+}
+
+bool serve(const char *path){
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    struct stat info;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "The socket path '%s' is too long.\n", path);
+        return false;
+    }
+    strcpy(address.sun_path, path);
+
+    // the inspectors are forked before the event loops start, a contest only sends them the changes
+    if (!contest.running && !startContestEngine()) return false;
+
+    if (stat(path, &info) == 0 && S_ISSOCK(info.st_mode))
+        unlink(path); // left behind by a previous run
+    server.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server.fd == -1 || bind(server.fd, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+        listen(server.fd, SOMAXCONN) == -1 || pipe(server.stop_fds) == -1) {
+        ipcError("Unable to listen on the socket.");
+        return false;
+    }
+
+    // the stop signals are waited for by this thread, the event loops are never interrupted
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threadCount = cores < 1 ? 1 : cores > SERVER_THREADS_MAX ? SERVER_THREADS_MAX : (size_t)cores;
+    for (server.threadCount = 0; server.threadCount < threadCount; ++server.threadCount) {
+        if (pthread_create(&server.threads[server.threadCount], NULL, serverLoop, NULL) != 0) break;
+    }
+    if (server.threadCount == 0) {
+        ipcError("Unable to start the event loops.");
+        return false;
+    }
+    printf("Serving on '%s' with %lu event loops, stop it with Ctrl+C.\n", path, server.threadCount);
+    fflush(stdout);
+
+    int received;
+    sigwait(&signals, &received);
+
+    // the blocking requests still post their replies to the event loops
+    pthread_mutex_lock(&server.mutex);
+    server.stopping = true;
+    while (server.jobs > 0)
+        pthread_cond_wait(&server.idle, &server.mutex);
+    pthread_mutex_unlock(&server.mutex);
+
+    close(server.stop_fds[1]);
+    for (size_t i = 0; i < server.threadCount; ++i) {
+        pthread_join(server.threads[i], NULL);
+    }
+    close(server.stop_fds[0]);
+    close(server.fd);
+    unlink(path);
+    printf("The server is stopped.\n");
+
+    return exitExecution();
+}
+
+void *serverLoop(void *args){
+    (void)args;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    int done_fds[2]; // the replies of the blocking requests of its clients
+    if (epoll_fd == -1) return NULL;
+    if (pipe2(done_fds, O_CLOEXEC) == -1) {
+        close(epoll_fd);
+        return NULL;
+    }
+
+    // every loop waits for new connections, but only one of them is woken up for each
+    struct epoll_event event = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server.fd, &event);
+    event = (struct epoll_event){.events = EPOLLIN, .data.ptr = &server};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server.stop_fds[0], &event);
+    event = (struct epoll_event){.events = EPOLLIN, .data.ptr = done_fds};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, done_fds[0], &event);
+
+    struct epoll_event events[SERVER_EVENTS];
+    bool running = true;
+    while (running) {
+        int n = epoll_wait(epoll_fd, events, SERVER_EVENTS, -1);
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.ptr == &server) {
+                running = false; // the connections still open are closed when the process exits
+            } else if (events[i].data.ptr == NULL) {
+                int fd;
+                while ((fd = accept4(server.fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+                    t_client *client = (t_client *) calloc(1, sizeof(t_client));
+                    if (client != NULL) {
+                        client->fd = fd;
+                        client->done_fd = done_fds[1];
+                        client->events = EPOLLIN;
+                        event = (struct epoll_event){.events = client->events, .data.ptr = client};
+                    }
+                    if (client == NULL || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+                        free(client);
+                        close(fd);
+                    }
+                }
+            } else if (events[i].data.ptr == done_fds) {
+                // a pointer is written at once, so it's read at once too
+                t_job *job;
+                if (read(done_fds[0], &job, sizeof(job)) != sizeof(job)) continue;
+
+                // the reply follows the replies of the requests before it
+                t_client *client = job->client;
+                const char *reply = job->reply != NULL ? job->reply : "ERR Out of memory!\n";
+                size_t replyLength = job->reply != NULL ? job->replyLength : strlen(reply);
+                size_t pending = client->outLength - client->outSent;
+                char *out = (char *) malloc(pending + replyLength);
+                if (out != NULL) {
+                    memcpy(out, client->out + client->outSent, pending);
+                    memcpy(out + pending, reply, replyLength);
+                    free(client->out);
+                    client->out = out;
+                    client->outLength = pending + replyLength;
+                    client->outSent = 0;
+                } else {
+                    client->closing = true; // the client would wait for the reply forever
+                }
+                client->job = NULL;
+                if (!job->success)
+                    kill(getpid(), SIGTERM); // the store is broken, the server is stopped
+                free(job->reply);
+                free(job);
+                handleClientEvent(epoll_fd, client);
+            } else {
+                handleClientEvent(epoll_fd, events[i].data.ptr);
+            }
+        }
+    }
+
+    close(done_fds[0]);
+    close(done_fds[1]);
+    close(epoll_fd);
+    return NULL;
+}
+
+void handleClientEvent(int epoll_fd, t_client *client){
+    bool open = flushClient(client);
+    if (open && client->job == NULL && client->outSent == client->outLength && !client->closing)
+        open = serveClient(client);
+    if (client->closing && client->job == NULL && client->outSent == client->outLength)
+        open = false;
+    if (!open && client->job != NULL) {
+        // the job still refers to the client, it's closed once the reply arrives
+        client->closing = true;
+        client->outSent = client->outLength;
+        open = true;
+    }
+    if (!open) {
+        close(client->fd);
+        free(client->out);
+        free(client);
+        return;
+    }
+
+    // no more requests are read while the replies or a blocking request are waiting,
+    // and a client having requests left over is served again only after the others
+    uint32_t wanted = client->outSent < client->outLength ? EPOLLOUT : client->job != NULL ? 0 :
+                      memchr(client->in, '\n', client->inLength) != NULL ? EPOLLOUT : EPOLLIN;
+    if (wanted != client->events) {
+        // the socket isn't watched during a job, a hang up couldn't be cleared meanwhile
+        struct epoll_event event = {.events = wanted, .data.ptr = client};
+        epoll_ctl(epoll_fd, wanted == 0 ? EPOLL_CTL_DEL : client->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                  client->fd, &event);
+        client->events = wanted;
+    }
+}
+
+bool serveClient(t_client *client){
+    char *replies = NULL;
+    size_t repliesLength = 0;
+    FILE *out = open_memstream(&replies, &repliesLength);
+    if (out == NULL) return false;
+
+    // the complete requests of the pipeline are answered up to the limit, then the replies are sent together
+    // a blocking request is handed over to a job, the requests after it wait for its reply
+    bool open = true, success = true;
+    int handled = 0;
+    while (true) {
+        char *start = client->in, *end;
+        while (!client->closing && client->job == NULL && handled < CLIENT_REQUESTS &&
+               (end = memchr(start, '\n', client->in + client->inLength - start)) != NULL) {
+            *end = '\0';
+            if (end > start && end[-1] == '\r') end[-1] = '\0';
+            client->closing = strcmp(start, "quit") == 0;
+            if (isBlockingRequest(start))
+                startJob(out, client, start);
+            else
+                success = handleRequest(out, start) && success;
+            handled++;
+            start = end + 1;
+        }
+        client->inLength -= start - client->in;
+        memmove(client->in, start, client->inLength);
+
+        if (client->inLength == REQUEST_SIZE) {
+            fprintf(out, "ERR The request is too long!\n");
+            client->closing = true;
+        }
+        if (client->closing || client->job != NULL || handled >= CLIENT_REQUESTS) break;
+
+        ssize_t n = read(client->fd, client->in + client->inLength, REQUEST_SIZE - client->inLength);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            open = errno == EAGAIN || errno == EWOULDBLOCK; // everything is read
+            break;
+        }
+        if (n == 0) {
+            client->closing = true; // the client won't send more, but it still gets the replies
+            break;
+        }
+        client->inLength += n;
+    }
+    fclose(out);
+
+    // the previous replies are sent already, the client isn't read while some are pending
+    free(client->out);
+    client->out = replies;
+    client->outLength = repliesLength;
+    client->outSent = 0;
+
+    if (!success)
+        kill(getpid(), SIGTERM); // the store is broken, the server is stopped
+    return open && flushClient(client);
+}
+
+bool isBlockingRequest(const char *request){
+    return strcmp(request, "sync") == 0 || strcmp(request, "start") == 0;
+}
+
+void startJob(FILE *out, t_client *client, const char *request){
+    t_job *job = (t_job *) calloc(1, sizeof(t_job));
+    if (job == NULL) {
+        fprintf(out, "ERR Out of memory!\n");
+        return;
+    }
+    job->client = client;
+    strncpy(job->request, request, REQUEST_SIZE - 1);
+
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    pthread_mutex_lock(&server.mutex);
+    bool started = !server.stopping && pthread_create(&thread, &attributes, jobMain, job) == 0;
+    if (started) server.jobs++; // the job can't be over before the mutex is released
+    pthread_mutex_unlock(&server.mutex);
+    pthread_attr_destroy(&attributes);
+
+    if (started) {
+        client->job = job;
+    } else {
+        fprintf(out, "ERR The server is busy or stopping!\n");
+        free(job);
+    }
+}
+
+void *jobMain(void *args){
+    t_job *job = args;
+    FILE *reply = open_memstream(&job->reply, &job->replyLength);
+    job->success = true;
+    if (reply != NULL) {
+        job->success = handleRequest(reply, job->request);
+        fclose(reply);
+    }
+
+    // the event loop of the client takes it over
+    write(job->client->done_fd, &job, sizeof(job));
+
+    pthread_mutex_lock(&server.mutex);
+    server.jobs--;
+    pthread_cond_signal(&server.idle);
+    pthread_mutex_unlock(&server.mutex);
+
+    return NULL;
+}
+
+bool flushClient(t_client *client){
+    while (client->outSent < client->outLength) {
+        ssize_t n = send(client->fd, client->out + client->outSent, client->outLength - client->outSent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK; // the rest is sent when the socket is writable
+        client->outSent += n;
+    }
+
+    return true;
+}
+
+bool handleRequest(FILE *out, char *line){
+    char *body = NULL;
+    size_t bodyLength = 0;
+    FILE *reply = open_memstream(&body, &bodyLength);
+    if (reply == NULL) {
+        fprintf(out, "ERR Out of memory!\n");
+        return true;
+    }
+
+    // the arguments follow the command after a space, separated by ';' like the columns of the linked file
+    char *args = strchr(line, ' ');
+    if (args) *args++ = '\0';
+    char *fields[4];
+    int fieldCount = splitFields(args, fields, 4);
+    size_t nameLimits[2] = {1, BUFFER_SIZE - 1}, newNameLimits[2] = {0, BUFFER_SIZE - 1}; // minLength, maxLength
+    size_t countLimits[2] = {1, 5}, newCountLimits[2] = {0, 5};
+    bool known = true, success = true;
+
+    if (strcmp(line, "ls") == 0 && fieldCount == 0)
+        success = writeRecords(reply, NULL);
+    else if (strcmp(line, "filter") == 0 && fieldCount == 1)
+        success = writeRecords(reply, fields[0]);
+    else if (strcmp(line, "mem") == 0 && fieldCount == 0)
+        success = writeMemoryUsage(reply);
+    else if (strcmp(line, "start") == 0 && fieldCount == 0)
+        success = startContest(reply);
+    else if (strcmp(line, "sync") == 0 && fieldCount == 0)
+        success = syncFile(reply);
+    else if (strcmp(line, "add") == 0 && fieldCount == 3 && lengthChecker(fields[0], nameLimits) &&
+             lengthAndOnlyDigitsAndIsPositiveChecker(fields[2], countLimits))
+        success = addRecord(reply, fields[0], fields[1], atoi(fields[2]));
+    else if (strcmp(line, "rem") == 0 && fieldCount == 1)
+        success = removeRecords(reply, fields[0]);
+    else if (strcmp(line, "mod") == 0 && fieldCount == 4 && lengthChecker(fields[1], newNameLimits) &&
+             lengthAndOnlyDigitsAndIsPositiveChecker(fields[3], newCountLimits))
+        success = modifyRecord(reply, fields[0], fields[1], fields[2], atoi(fields[3]));
+    else if (strcmp(line, "quit") != 0 || fieldCount != 0)
+        known = false;
+    fclose(reply);
+
+    // the reply starts with the number of its lines, so the client knows where the next one starts
+    if (known) {
+        size_t lines = 0;
+        for (size_t i = 0; i < bodyLength; ++i) {
+            if (body[i] == '\n') lines++;
+        }
+        fprintf(out, "OK %lu\n", lines);
+        fwrite(body, 1, bodyLength, out);
+    } else {
+        fprintf(out, "ERR Usage: ls | filter area | mem | start | sync | add name;area;application count | rem name | "
+                     "mod name;new name;new area;new application count | quit\n");
+    }
+    free(body);
+
+    return success;
+}
+
+void appendRecord(t_slot newRecord) {
+    list.iterator[list.count++] = newRecord;
+    if (list.count >= list.size) growIterator(list.size + GROW_BY);
+    trackPeakUsage();
+}
+
+bool removeAllRecord(void) {
     int dropped = 0;
+    bool success = true;
     for (int i = 0; i < list.count; ++i) {
-        if (list.iterator[i] != NULL){
-            free(list.iterator[i]);
-            list.iterator[i] = NULL;
+        if (list.iterator[i] != NO_SLOT){
+            success = freeRecord(list.iterator[i]);
+            if (!success) break;
+            list.iterator[i] = NO_SLOT;
             list.freed++;
             dropped++;
         }
@@ -728,34 +2606,23 @@ void removeAllRecord(void) {
     if (dropped > 0){
         manageAllocatedSpace();
     }
-}
-
-void reopenFile(void){
-    if (linkedFile.fp != NULL){
-        linkedFile.fp = fopen(linkedFile.name, "wb+");
 
-        if (linkedFile.fp == NULL)
-            fileError("Unable to link to file!");
-    }
+    return success;
 }
 
 void noMemoryError(void){
-    freeAllocated();
     fprintf(stderr, "\nOut of memory!");
 }
 
 void fileError(const char *msg){
-    freeAllocated();
     fprintf(stderr, "%s: %s\n", "File error: ", msg);
 }
 
 void ipcError(const char *msg){
-    freeAllocated();
     fprintf(stderr, "%s: %s\n", "IPC error: ", msg);
 }
 
 void assertionError(const char *msg){
-    freeAllocated();
     fprintf(stderr, "%s: %s\n", "Assertion error: ", msg);
     exit(1);
 }
@@ -764,6 +2631,44 @@ static int randomBetween(int lower, int upper){
     return (rand() % (upper - lower + 1)) + lower;
 }
 
+static unsigned hashName(const char *name){
+    unsigned hash = 2166136261u;
+    for (const unsigned char *c = (const unsigned char *)name; *c; ++c) {
+        hash = (hash ^ *c) * 16777619u;
+    }
+    return hash;
+}
+
+static int splitFields(char *args, char **fields, int max){
+    int count = 0;
+    if (args == NULL || *args == '\0') return 0;
+
+    // empty fields are kept, "mod" uses them for the unchanged values
+    do {
+        if (count == max) return -1;
+        fields[count++] = args;
+        if ((args = strchr(args, ';')) != NULL) *args++ = '\0';
+    } while (args != NULL);
+
+    return count;
+}
+
+static size_t findRowSlot(const size_t *index, size_t indexSize, const t_row *rows, const char *name){
+    // linear probing, the table is never more than half full
+    size_t i = hashName(name) & (indexSize - 1);
+    while (index[i] != 0 && strcmp(rows[index[i] - 1].name, name) != 0)
+        i = (i + 1) & (indexSize - 1);
+    return i;
+}
+
+static size_t findRecordSlot(const size_t *index, size_t indexSize, const char *name){
+    // linear probing over the positions of the iterator, the table is never more than half full
+    size_t i = hashName(name) & (indexSize - 1);
+    while (index[i] != 0 && strcmp(recordAt((int)index[i] - 1)->name, name) != 0)
+        i = (i + 1) & (indexSize - 1);
+    return i;
+}
+
 static void emptyBuffer(void){
     int c;
     while ((c = getchar()) != '\n' && c != EOF) { }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // vmsplice, mremap
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
@@ -11,56 +12,280 @@
 #include <sys/stat.h>
 #include <sys/shm.h>
 #include <sys/sem.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h> //vmsplice
+#include <stdarg.h>
+#include <stdint.h> //SIZE_MAX
 
 #define BUFF_SIZE 128 // buffer size
-#define PROC_COUNT 2 // number of processes
-#define PARTY_COUNT 6 // number of parties
+#define ID_MIN 10000 // smallest voter id
+#define ID_MAX 99999 // largest voter id
+#define ID_WORDS ((ID_MAX - ID_MIN) / 64 + 1) // words of the bitset of the ids already seen
+#define WORKER_MAX 16 // max. number of validator workers ('child1')
+#define PROC_MAX (WORKER_MAX + 1) // max. number of processes: the validators and child2
+#define PARTY_COUNT 6 // default number of parties
+#define PARTY_MAX 4096 // max. number of parties
+#define TOP_COUNT 10 // default number of parties in the results
+#define CHUNK_SIZE 1024 // default number of voters streamed between the stages at once
+#define CHUNK_MAX (1 << 22) // max. number of voters in a chunk
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024) // batches are rounded up to this with huge pages
+#define VOTE_BATCH_SIZE 512 // votes sent from child2 to the parent at once
+#define VOTE_FLUSH_MS 50 // votes waiting longer than this are sent even if the batch isn't full
+#define RING_SLOTS 16 // number of slots in a shared memory ring
+#define RING_SLOT_SIZE 65536 // bytes in one slot of a shared memory ring
+#define LOG_BUFFER_SIZE 65536 // bytes of log lines a process collects before writing them out
+#define BENCH_MIN 1000 // smallest voter count of the benchmark sweep
+#define BENCH_MAX 100000000 // default largest voter count of the benchmark sweep
+#define BENCH_SAMPLES 262144 // latency samples kept per stage, the rest is only counted
+#define WRITER_BUFFER_SIZE (4 * 1024 * 1024) // bytes collected before the writer thread writes them out
+#define OUTPUT_VERSION 1 // version of the binary result and audit files
+#define READ_AHEAD_SIZE 4096 // bytes a FIFO reader takes beyond the requested ones, usually the next message header
+
+enum { TRANSPORT_FIFO, TRANSPORT_SHM, TRANSPORT_SPLICE }; /* how the stages pass data to each other */
+enum { SEM_FREE, SEM_FILLED }; /* semaphores of a ring: free and filled slots */
+enum { LOG_RESULT, LOG_INFO, LOG_DEBUG, LOG_TRACE }; /* verbosity levels, the results are always printed */
+enum { STAGE_GENERATION, STAGE_VALIDATION, STAGE_STATS, STAGE_VOTING, STAGE_TALLY, STAGE_COUNT }; /* measured stages */
+enum { REJECT_NONE, REJECT_INVALID, REJECT_DUPLICATE }; /* why the validation has rejected a voter */
+enum { MSG_VOTERS, MSG_VOTES, MSG_STATS, MSG_HISTOGRAM, MSG_END }; /* types of the messages sent between the stages, MSG_END closes an election */
 
 typedef struct data {
     int id;
     int voted_for;
     int is_valid;
+    int reason; /* REJECT_NONE for the valid voters */
 } t_data;
 
 typedef struct stats {
     int valid_votes;
     int invalid_votes;
+    int duplicate_votes; /* the invalid ones rejected as duplicates */
 } t_stats;
 
+/* ids the validators have already accepted or rejected, shared by the workers */
+typedef struct id_set {
+    unsigned long words[ID_WORDS];
+} t_id_set;
+
 typedef struct vote {
     int id;
     int party;
 } t_vote;
 
+/* header of a message, length bytes of payload follow it */
+typedef struct frame {
+    int type;
+    size_t length;
+} t_frame;
+
+/* one slot of a shared memory ring, len == 0 marks the end of the stream */
+typedef struct ring_slot {
+    size_t len;
+    char data[RING_SLOT_SIZE];
+} t_ring_slot;
+
+/* single-producer / single-consumer ring buffer in shared memory */
+typedef struct ring {
+    t_ring_slot slots[RING_SLOTS];
+} t_ring;
+
 /* used to collect data to be sent over pipe */
 typedef struct batch {
     size_t size; /* actual size */
     size_t cap;  /* capacity */
     t_data *batch;     /* the items */
+    bool huge;   /* the items are on reserved huge pages, the mapping is sized in their multiples */
 } t_batch;
 
+/* one hop of the pipeline: a named pipe or a shared memory ring */
+typedef struct channel {
+    char name[BUFF_SIZE]; /* FIFO: path of the named pipe */
+    int fd;               /* FIFO: descriptor of the opened pipe */
+    t_ring *ring;         /* SHM: the ring shared by the two stages */
+    int sem_id;           /* SHM: semaphores counting the free and the filled slots */
+    int flags;            /* the side of the channel this process has opened (O_RDONLY / O_WRONLY) */
+    size_t pos, offset;   /* SHM: next slot of this side, read offset inside the current slot */
+    char *ahead;          /* FIFO: bytes read beyond the previous read */
+    size_t ahead_pos, ahead_len;
+    size_t pipe_pages;    /* SPLICE: page slots of the pipe, at most the pages of a chunk */
+    t_batch spare;        /* SPLICE: the pages spliced with the previous chunk, reused once the reader is past them */
+} t_channel;
+
+/* votes collected by child2 before sending them to the parent */
+typedef struct vote_batch {
+    size_t size;
+    struct timespec since; /* time of the first vote in the batch */
+    t_vote votes[VOTE_BATCH_SIZE];
+} t_vote_batch;
+
+/* latencies of one stage, filled by every process running it */
+typedef struct stage_timing {
+    long count;  /* chunks handled, may exceed BENCH_SAMPLES */
+    long items;  /* voters / votes in these chunks */
+    long busy;   /* ns spent on them */
+    long samples[BENCH_SAMPLES]; /* ns spent on one chunk */
+} t_stage_timing;
+
+/* measurements of one election in benchmark mode, shared by the stages */
+typedef struct bench {
+    t_stage_timing stages[STAGE_COUNT];
+} t_bench;
+
+/* when the stages have handled a chunk, the audit reads it by the index of the chunk in the election */
+typedef struct chunk_stamps {
+    long generated;
+    long validated;
+} t_chunk_stamps;
+
+/* start of the binary result ("NVPR") and audit ("NVPA") files */
+typedef struct file_header {
+    char magic[4];
+    int version;
+    int party_count;
+    int record_size; /* bytes of a record, the results have party_count votes after every record */
+} t_file_header;
+
+/* one election in the result file, followed by the votes of the parties */
+typedef struct result_record {
+    int election;
+    int valid_votes;
+    int invalid_votes;
+    int duplicate_votes;
+} t_result_record;
+
+/* one voter in the audit file, the times are CLOCK_MONOTONIC ns */
+typedef struct audit_record {
+    int election;
+    int id;
+    int party;  /* 0 for the rejected voters */
+    int reason;
+    long generated, validated, voted;
+} t_audit_record;
+
+/* writes a file through two large buffers: one is filled while a thread writes out the other */
+typedef struct writer {
+    int fd;
+    char *buffers[2];
+    int filling;          /* the buffer being filled */
+    size_t len;           /* bytes in the buffer being filled */
+    size_t pending;       /* bytes of the other buffer to be written out, 0 if it's free */
+    bool closing;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} t_writer;
+
+/* arguments of the voter generator thread of the parent */
+typedef struct generator {
+    t_channel *channels; /* one channel per validator worker */
+    int channel_count;
+    int count;
+    int sem_id;
+    t_bench *bench;
+    t_chunk_stamps *stamps; /* NULL without the audit */
+} t_generator;
+
+void runElections(int, int, int, t_bench *); /* Starts the pipeline once and runs the elections on it one after the other, measuring the stages if bench isn't NULL */
+void runBenchmark(int, int, int); /* Runs elections of growing voter counts without the breaks and reports the stages */
+bool idSetInsert(t_id_set *, int); /* Marks the id as seen, false if it had been seen before */
+void benchRecord(t_bench *, int, const struct timespec *, long); /* Records the time since the given one as a chunk of the stage */
+void benchReport(t_bench *, int, int, long); /* Prints the throughput and the latency percentiles of the elections */
+void writerOpen(t_writer *, const char *, const t_file_header *); /* Creates the file with the header and starts the writer thread */
+void writerWrite(t_writer *, const void *, size_t); /* Collects the bytes, waits only if both buffers are full */
+void writerClose(t_writer *); /* Writes out the rest and closes the file */
+void *writerMain(void *); /* Writer thread: writes out the full buffers */
 void goOut(int, char *); /* Take a brake */
+void takeTime(long); /* Sleeps the given ms to simulate work, not in benchmark mode */
+void logWrite(int, const char *, ...); /* Collects the line if the verbosity allows it, the lines up to info are written out at once */
+void logFlush(void); /* Writes out the collected lines of this process */
 void getPipeName(char *, int, char *); /* Gets name of pipe according to process id */
-void batchInit(t_batch *); /* Initializes the batch */
+void batchInit(t_batch *, size_t); /* Initializes the batch with room for the given number of items */
 void batchAdd(t_batch *, t_data); /* Adds an item to the batch */
-void batchDestroy(t_batch *); /* Initializes the batch */
+void batchReserve(t_batch *, size_t); /* Makes room for the given number of items */
+void batchReadPayload(t_channel *, const t_frame *, t_batch *); /* Reads the voters of the message into the batch */
+void batchSend(t_channel *, t_batch *); /* Sends the batch as one chunk */
+void voteAdd(t_channel *, t_vote_batch *, t_vote); /* Adds a vote, sending the batch when it's full or old enough */
+void voteFlush(t_channel *, t_vote_batch *); /* Sends the collected votes to the parent */
+void *generateVoters(void *); /* Parent thread: generates the voters and streams them to child1 in chunks */
+int *histogramCreate(void); /* Allocates a zeroed vote histogram of party_count parties */
+void histogramMerge(int *, const int *); /* Adds the second histogram to the first */
+int topParties(const int *, int *, int); /* Fills the indices of the parties with the most votes, returns their number */
+void batchDestroy(t_batch *); /* Frees the items of the batch */
+void dataAlloc(t_batch *, size_t); /* (Re)allocates the items of a batch on pages of their own for the given capacity */
+void dataFree(t_batch *); /* Frees the items of a batch */
+void channelCreate(t_channel *, char *); /* Creates a channel before forking, postfix names the FIFO */
+void channelOpen(t_channel *, int); /* Opens one side of the channel (O_RDONLY / O_WRONLY) */
+void channelWrite(t_channel *, const void *, size_t); /* Writes all the bytes into the channel */
+void channelSend(t_channel *, int, const void *, size_t); /* Sends a message: the header and the payload at once */
+bool channelReceive(t_channel *, t_frame *); /* Reads the header of the next message, false at the end of the stream */
+void channelReadPayload(t_channel *, const t_frame *, void *, size_t); /* Reads the payload of the message into a buffer of the given size */
+void channelSplice(t_channel *, void *, size_t); /* Maps the pages into the pipe, they mustn't be touched until the reader has consumed them */
+size_t channelRead(t_channel *, void *, size_t); /* Reads the given bytes, less only at the end of the stream */
+void channelClose(t_channel *); /* Closes the opened side, the reader gets the end of the stream */
+void channelDestroy(t_channel *); /* Removes the channel when no stage uses it anymore */
 int sem_create(const char*, int);
+int sem_create_private(int, unsigned short *); /* creates a set of semaphores without a key */
 void sem_op(int, int);
+void sem_op_at(int, int, int); /* operation on one semaphore of a set */
 void sem_destroy(int);
 void noMemoryError(void); /* Handles memory shortage -> prints message to stderr */
 void fileError(const char *); /* Handles file errors -> prints message to stderr */
 void ipcError(const char *); /* Handles IPC errors -> prints message to stderr */
 void assertionError(const char*); /* Handles assertion errors -> prints message to stderr */
+static size_t dataMapSize(size_t, bool); /* bytes mapped for the given number of items, on huge pages or not */
 static int randomBetween(int, int); /* gets a random number between [lower, upper] */
+static void writeFull(int, struct iovec *, int); /* writes every part, continuing after partial writes */
+static void logWriteOut(void); /* writes the log buffer to stdout in one piece, the log mutex is held */
+static long elapsedMs(const struct timespec *); /* milliseconds since the given time */
+static long elapsedNs(const struct timespec *); /* nanoseconds since the given time */
+static long nowNs(void); /* CLOCK_MONOTONIC in nanoseconds */
+static int compareLong(const void *, const void *); /* qsort comparator of longs */
 static void emptyBuffer(void); /* empties buffer if it's overloaded (if fgets wasn't able to put \n in the array) */
 
-static volatile int sigCount = 0;
-void handler(int sig_number){ sigCount++; }
-void empty_handler(int sig_number){ }
+static int transport = TRANSPORT_FIFO;
+static int worker_count = 1; /* number of validator workers */
+static int party_count = PARTY_COUNT;
+static int top_count = TOP_COUNT; /* number of parties listed in the results */
+static int chunk_size = CHUNK_SIZE;
+static int election_count = 1; /* elections run one after the other by the same processes */
+static const char *results_path = NULL; /* binary results of the elections */
+static const char *audit_path = NULL; /* binary record of every voter */
+static bool huge_pages = false; /* back the batches by huge pages if the system has any */
+static bool benchmark = false; /* no breaks and no simulated work, the stages are measured */
+static int log_level = LOG_INFO;
+static char log_buffer[LOG_BUFFER_SIZE]; /* lines of this process not written out yet */
+static size_t log_len = 0;
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER; /* the generator thread of the parent logs too */
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2){
+    int opt;
+    bool verbosity_set = false;
+    while ((opt = getopt(argc, argv, "t:w:p:k:c:e:o:a:Hvqb")) != -1) {
+        if (opt == 't' && strcmp(optarg, "fifo") == 0) transport = TRANSPORT_FIFO;
+        else if (opt == 't' && strcmp(optarg, "shm") == 0) transport = TRANSPORT_SHM;
+        else if (opt == 't' && strcmp(optarg, "splice") == 0) transport = TRANSPORT_SPLICE;
+        else if (opt == 'w' && atoi(optarg) >= 1 && atoi(optarg) <= WORKER_MAX) worker_count = atoi(optarg);
+        else if (opt == 'p' && atoi(optarg) >= 1 && atoi(optarg) <= PARTY_MAX) party_count = atoi(optarg);
+        else if (opt == 'k' && atoi(optarg) >= 1) top_count = atoi(optarg);
+        else if (opt == 'v' && log_level < LOG_TRACE) { log_level++; verbosity_set = true; }
+        else if (opt == 'q') { log_level = LOG_RESULT; verbosity_set = true; }
+        else if (opt == 'b') benchmark = true;
+        else if (opt == 'c' && atoi(optarg) >= 1 && atoi(optarg) <= CHUNK_MAX) chunk_size = atoi(optarg);
+        else if (opt == 'H') huge_pages = true;
+        else if (opt == 'e' && atoi(optarg) >= 1) election_count = atoi(optarg);
+        else if (opt == 'o') results_path = optarg;
+        else if (opt == 'a') audit_path = optarg;
+        else {
+            fprintf(stderr, "Usage: %s [-t fifo|shm|splice] [-w validator_workers] [-p parties] [-k top_parties] [-c chunk_size] [-H] [-e elections] [-o results_file] [-a audit_file] [-v|-vv|-q] [-b] voter_count\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (benchmark && !verbosity_set) log_level = LOG_RESULT; // only the report by default
+    if (transport == TRANSPORT_SPLICE) huge_pages = false; // the pipe is sized in normal pages
+
+    if (optind >= argc && !benchmark){
         fprintf(stderr, "Specify voter count in the arguments!\n");
         exit(1);
     }
@@ -68,307 +293,931 @@ int main(int argc, char *argv[])
     key_t sem_key = ftok(argv[0], 1);
     int sem_id = sem_create(argv[0], 1); // semaphore is UP
 
-    pid_t proc_ids[PROC_COUNT];
+    // in benchmark mode the voter count is the end of the sweep
+    if (benchmark) runBenchmark(sem_id, optind < argc ? atoi(argv[optind]) : BENCH_MAX, election_count);
+    else runElections(sem_id, atoi(argv[optind]), election_count, NULL);
+
+    sem_destroy(sem_id); // delete semaphore
+    logFlush();
+}
+
+void runElections(int sem_id, int voter_count, int count, t_bench *bench) {
+    // create the hops of the pipeline before forking, so every stage inherits them
+    // every validator worker has its own channel from the parent and to child2
+    t_channel to_child1[WORKER_MAX], btw_children[WORKER_MAX], to_parent;
+    for (int i = 0; i < worker_count; ++i) {
+        char postfix[BUFF_SIZE];
+        sprintf(postfix, "_to_child1_%d", i);
+        channelCreate(&to_child1[i], postfix);
+        sprintf(postfix, "_btw_children_%d", i);
+        channelCreate(&btw_children[i], postfix);
+    }
+    channelCreate(&to_parent, "_to_parent");
+
+    int proc_count = worker_count + 1;
+    pid_t proc_ids[PROC_MAX];
+
+    // one bitset for the validator workers, so a duplicate is found whichever worker gets it
+    t_id_set *seen_ids = mmap(NULL, sizeof(t_id_set), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (seen_ids == MAP_FAILED) { noMemoryError(); }
+
+    // the stages note when they have handled a chunk, child2 puts it into the audit
+    size_t chunk_count = voter_count / chunk_size + 1;
+    t_chunk_stamps *stamps = NULL;
+    if (audit_path != NULL) {
+        stamps = mmap(NULL, chunk_count * sizeof(t_chunk_stamps), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (stamps == MAP_FAILED) { noMemoryError(); }
+    }
+
+    // readiness barrier: every child increases it once, the parent waits until it reaches proc_count
+    unsigned short ready_val = 0;
+    int ready_sem_id = sem_create_private(1, &ready_val);
+    logFlush(); // the children mustn't inherit the lines of the parent
 
-    for (int ind = 0; ind < PROC_COUNT; ++ind) {
-        if ((proc_ids[ind] = fork()) < 0) { ipcError("Forking was unsuccessful."); return false; }
+    for (int ind = 0; ind < proc_count; ++ind) {
+        if ((proc_ids[ind] = fork()) < 0) { ipcError("Forking was unsuccessful."); }
 
         if (proc_ids[ind] == 0) {
             /* Child processes */
             /* common tasks go here */
             srand(time(NULL) ^ (getpid()<<16)); // seed random
-            // pause(); // wait until start signal
 
             /* child specific tasks go here */
-            if (ind == 0){
-                /* Child1: 'ellenőriz' */
-                printf("child1 is preparing\n"); fflush(stdout);
-                sleep(randomBetween(1, 3)); // preparation time
+            if (ind < worker_count){
+                /* Child1: 'ellenőriz' - one of the validator workers, checking every worker_count. chunk */
+                char name[BUFF_SIZE];
+                sprintf(name, "child1.%d", ind + 1);
+                logWrite(LOG_INFO, "%s is preparing\n", name);
+                takeTime(randomBetween(1000, 3000)); // preparation time
+
+                // open pipe to communicate with child2
+                channelOpen(&btw_children[ind], O_WRONLY);
 
-                // open pipe to communicate with child1
-                char to_child2_pipe[BUFF_SIZE];
-                getPipeName(to_child2_pipe, getppid(), "_btw_children");
-                int to_child2_fd = open(to_child2_pipe, O_WRONLY);
+                logWrite(LOG_INFO, "%s is ready\n", name);
+                sem_op(ready_sem_id, 1);  // tell parent: child1 is ready
 
-                printf("child1 is ready\n"); fflush(stdout);
-                kill(getppid(), SIGUSR1);  // signal parent: child1 is ready
+                channelOpen(&to_child1[ind], O_RDONLY);
 
-                // read child2 pid and voter data from pipe
-                pid_t child2_pid;
+                goOut(sem_id, name);
+
+                // check the voters chunk by chunk, and pass them on to child2 as soon as they are checked
+                // the elections follow each other until the parent closes the stream
                 t_batch voters;
-                char to_parent_pipe[BUFF_SIZE];
-                getPipeName(to_parent_pipe, getpid(), "");
-                int to_parent_fd = open(to_parent_pipe, O_RDONLY);
-                read(to_parent_fd, &child2_pid, sizeof(pid_t));
-                read(to_parent_fd, &voters.size, sizeof(voters.size));
-                voters.batch = (t_data *) malloc(voters.size * sizeof(t_data));
-                if (voters.batch == NULL) { noMemoryError(); }
-                read(to_parent_fd, voters.batch, voters.size * sizeof(t_data));
-                close(to_parent_fd);
-
-                goOut(sem_id, "child1");
-
-                // print the received data
-                printf("child1 has received the data from the parent:\n"); fflush(stdout);
-                for (int i = 0; i < voters.size; ++i) {
-                    printf("\tid. %d\n", voters.batch[i].id); fflush(stdout);
-                }
+                batchInit(&voters, chunk_size); // no chunk is larger, so it is never reallocated
+                struct timespec started;
+                size_t validated = 0;
+                int chunk = ind; // index of the chunk in the election, the workers get every worker_count. one
+                bool checking = false; // an election has started
+                t_frame frame;
+                while (channelReceive(&to_child1[ind], &frame)) {
+                    if (!checking) {
+                        logWrite(LOG_INFO, "%s is checking whether the ids are valid.\n", name);
+                        takeTime(randomBetween(1000, 3000)); // time to validate
+                        clock_gettime(CLOCK_MONOTONIC, &started);
+                        validated = 0;
+                        checking = true;
+                    }
 
-                // check if identifier is valid
-                printf("child1 is checking whether the ids are valid.\n"); fflush(stdout);
-                sleep(randomBetween(1, 3)); // time to validate
-                for (int i = 0; i < voters.size; ++i) {
-                    voters.batch[i].is_valid = (randomBetween(1, 100) > 20);
-                }
-                printf("child1 is done with validation.\n"); fflush(stdout);
+                    if (frame.type == MSG_END) {
+                        // the end of the election tells child2 that there are no more voters
+                        channelSend(&btw_children[ind], MSG_END, NULL, 0);
+                        logWrite(LOG_INFO, "%s is done with validation: %lu voters in %ld ms.\n", name, validated, elapsedMs(&started));
+                        checking = false;
+                        chunk = ind;
 
-                goOut(sem_id, "child1");
+                        goOut(sem_id, name);
+                        continue;
+                    }
 
-                // send voters to child2 after checking identifiers
-                printf("child1 is sending the validated data to child2.\n"); fflush(stdout);
-                write(to_child2_fd, &voters.size, sizeof(voters.size)); // send count first
-                write(to_child2_fd, voters.batch, voters.size * sizeof(t_data)); // send voters after
-                close(to_child2_fd);
+                    batchReadPayload(&to_child1[ind], &frame, &voters);
+                    logWrite(LOG_DEBUG, "%s has received %lu voters from the parent:\n", name, voters.size);
+                    struct timespec chunk_start;
+                    clock_gettime(CLOCK_MONOTONIC, &chunk_start);
+                    for (int i = 0; i < voters.size; ++i) {
+                        logWrite(LOG_TRACE, "\tid. %d\n", voters.batch[i].id);
+                        t_data *voter = &voters.batch[i];
+                        if (!idSetInsert(seen_ids, voter->id)) voter->reason = REJECT_DUPLICATE;
+                        else voter->reason = randomBetween(1, 100) > 20 ? REJECT_NONE : REJECT_INVALID;
+                        voter->is_valid = voter->reason == REJECT_NONE;
+                    }
+                    benchRecord(bench, STAGE_VALIDATION, &chunk_start, voters.size);
+                    if (stamps != NULL) stamps[chunk].validated = nowNs();
+                    chunk += worker_count;
 
-                kill(child2_pid, SIGUSR2); // notify child2 that data is ready
+                    validated += voters.size;
+                    batchSend(&btw_children[ind], &voters);
+                }
+                channelClose(&to_child1[ind]);
+                channelClose(&btw_children[ind]);
 
-                //free(voters.batch);
                 batchDestroy(&voters);
             }
 
-            else if (ind == 1){
+            else if (ind == worker_count){
                 /* Child2: 'pecsétel' */
-                printf("child2 is preparing\n"); fflush(stdout);
-                signal(SIGUSR2, empty_handler);  // set signal handler so it won't kill the process
-                sleep(1); // to avoid race
+                logWrite(LOG_INFO, "child2 is preparing\n");
 
-                // open pipe to communicate with child1
-                char to_child1_pipe[BUFF_SIZE];
-                getPipeName(to_child1_pipe, getppid(), "_btw_children");
-                int to_child1_fd = open(to_child1_pipe, O_RDONLY);
+                // open pipes to communicate with the validator workers
+                for (int i = 0; i < worker_count; ++i) {
+                    channelOpen(&btw_children[i], O_RDONLY);
+                }
 
                 // prepare, then tell parent that child2 is ready
-                sleep(randomBetween(1, 3)); // preparation time
-                printf("child2 is ready\n"); fflush(stdout);
-                kill(getppid(), SIGUSR1);  // signal parent: child2 is ready
+                takeTime(randomBetween(1000, 3000)); // preparation time
+                logWrite(LOG_INFO, "child2 is ready\n");
+                sem_op(ready_sem_id, 1);  // tell parent: child2 is ready
 
                 goOut(sem_id, "child2");
 
-                // wait until signal that data is ready
-                pause();
-                // read voter data from pipe
-                t_batch voters;
-                read(to_child1_fd, &voters.size, sizeof(voters.size));
-                voters.batch = (t_data *) malloc(voters.size * sizeof(t_data));
-                if (voters.batch == NULL) { noMemoryError(); }
-                read(to_child1_fd, voters.batch, voters.size * sizeof(t_data));
-                close(to_child1_fd);
-
-                // print received data
-                printf("child2 has received the data from child1:\n"); fflush(stdout);
-                for (int i = 0; i < voters.size; ++i) {
-                    printf("\tid. %d - %d\n", voters.batch[i].id, voters.batch[i].is_valid); fflush(stdout);
-                }
-
-                goOut(sem_id, "child2");
+                channelOpen(&to_parent, O_WRONLY);
 
-                // count valid data
-                printf("child2 is calculating the voting stats.\n"); fflush(stdout);
-                sleep(randomBetween(1,3));  // count duration
-                t_stats stats = {0, 0};
-                for (int i = 0; i < voters.size; ++i) {
-                    stats.valid_votes += voters.batch[i].is_valid;
+                // count and vote chunk by chunk, while the validators are still checking the next ones
+                // the chunks are taken from the workers in the order the parent has dealt them out
+                t_stats stats = {0, 0, 0};
+                t_vote_batch votes = {0};
+                int *histogram = histogramCreate(); // votes per party counted locally
+                t_batch voters;
+                batchInit(&voters, chunk_size); // no chunk is larger, so it is never reallocated
+                struct timespec started;
+                bool voting = false; // an election has started
+                int worker = 0;
+                int election = 1, chunk = 0;
+                t_writer audit;
+                if (audit_path != NULL) {
+                    t_file_header header = {{'N', 'V', 'P', 'A'}, OUTPUT_VERSION, party_count, sizeof(t_audit_record)};
+                    writerOpen(&audit, audit_path, &header);
                 }
-                stats.invalid_votes = (int)voters.size - stats.valid_votes;
-
-                // send stats to parent
-                printf("child2 is sending the stats to the parent.\n"); fflush(stdout);
-                char to_parent_pipe[BUFF_SIZE];
-                getPipeName(to_parent_pipe, getpid(), "");
-                int to_parent_fd = open(to_parent_pipe, O_WRONLY);
-                write(to_parent_fd, &stats, sizeof(stats));
+                t_frame frame;
+                while (channelReceive(&btw_children[worker], &frame)) {
+                    if (!voting) {
+                        logWrite(LOG_INFO, "child2 is calculating the voting stats.\n");
+                        takeTime(randomBetween(1000, 3000));  // count duration
+                        logWrite(LOG_INFO, "child2: the voting has started.\n");
+                        clock_gettime(CLOCK_MONOTONIC, &started);
+                        voting = true;
+                    }
 
-                // the voting
-                goOut(sem_id, "child2");
+                    if (frame.type == MSG_END) {
+                        // the chunks were dealt out in turn, so the rest of the workers are at the end too
+                        for (int i = 1; i < worker_count; ++i) {
+                            t_channel *channel = &btw_children[(worker + i) % worker_count];
+                            if (!channelReceive(channel, &frame) || frame.type != MSG_END) { assertionError("A validator hasn't finished the election."); }
+                        }
+                        if (votes.size > 0) voteFlush(&to_parent, &votes);
+                        logWrite(LOG_INFO, "child2 is done with the voting: %d voters in %ld ms.\n",
+                                 stats.valid_votes + stats.invalid_votes, elapsedMs(&started));
+
+                        goOut(sem_id, "child2");
+
+                        // the stats and the tally of this voting worker follow the votes, then the end of the election
+                        logWrite(LOG_INFO, "child2 is sending the stats to the parent.\n");
+                        channelSend(&to_parent, MSG_STATS, &stats, sizeof(stats));
+                        channelSend(&to_parent, MSG_HISTOGRAM, histogram, party_count * sizeof(int));
+                        channelSend(&to_parent, MSG_END, NULL, 0);
+
+                        memset(&stats, 0, sizeof(stats));
+                        memset(histogram, 0, party_count * sizeof(int));
+                        worker = 0;
+                        voting = false;
+                        election++;
+                        chunk = 0;
+                        continue;
+                    }
 
-                printf("child2: the voting has started.\n"); fflush(stdout);
-                for (int i = 0; i < voters.size; ++i) {
-                    if (voters.batch[i].is_valid){
-                        usleep(randomBetween(150, 350)); // voting time
-                        t_vote vote = {voters.batch[i].id, randomBetween(1, PARTY_COUNT)};
-                        write(to_parent_fd, &vote, sizeof(vote));
-                        printf("child2: %d has submitted her/his vote.\n", voters.batch[i].id); fflush(stdout);
+                    batchReadPayload(&btw_children[worker], &frame, &voters);
+                    logWrite(LOG_DEBUG, "child2 has received %lu voters from child1.%d:\n", voters.size, worker + 1);
+                    worker = (worker + 1) % worker_count;
+                    struct timespec chunk_start;
+                    clock_gettime(CLOCK_MONOTONIC, &chunk_start);
+                    int valid_before = stats.valid_votes;
+                    for (int i = 0; i < voters.size; ++i) {
+                        logWrite(LOG_TRACE, "\tid. %d - %d (reason %d)\n", voters.batch[i].id, voters.batch[i].is_valid, voters.batch[i].reason);
+                        stats.valid_votes += voters.batch[i].is_valid;
+                        stats.invalid_votes += !voters.batch[i].is_valid;
+                        stats.duplicate_votes += voters.batch[i].reason == REJECT_DUPLICATE;
                     }
-                }
+                    benchRecord(bench, STAGE_STATS, &chunk_start, voters.size);
+
+                    clock_gettime(CLOCK_MONOTONIC, &chunk_start);
+                    for (int i = 0; i < voters.size; ++i) {
+                        t_vote vote = {voters.batch[i].id, 0};
+                        if (voters.batch[i].is_valid){
+                            if (!benchmark) usleep(randomBetween(150, 350)); // voting time
+                            vote.party = randomBetween(1, party_count);
+                            histogram[vote.party-1]++;
+                            voteAdd(&to_parent, &votes, vote);
+                            logWrite(LOG_TRACE, "child2: %d has submitted her/his vote.\n", voters.batch[i].id);
+                        }
+                        if (stamps != NULL) {
+                            t_audit_record record = {election, vote.id, vote.party, voters.batch[i].reason,
+                                                     stamps[chunk].generated, stamps[chunk].validated, vote.party > 0 ? nowNs() : 0};
+                            writerWrite(&audit, &record, sizeof(record));
+                        }
+                    }
+                    benchRecord(bench, STAGE_VOTING, &chunk_start, stats.valid_votes - valid_before);
+                    chunk++;
 
-                close(to_parent_fd);
-                //free(voters.batch);
+                    // don't keep the votes back while waiting for the next chunk
+                    if (votes.size > 0 && elapsedMs(&votes.since) >= VOTE_FLUSH_MS) voteFlush(&to_parent, &votes);
+                }
+                for (int i = 0; i < worker_count; ++i) {
+                    channelClose(&btw_children[i]);
+                }
+                channelClose(&to_parent);
+                if (audit_path != NULL) writerClose(&audit);
+                free(histogram);
                 batchDestroy(&voters);
             }
 
+            logFlush();
             _exit(0);  // for every child
         }
     }
 
     /* Parent: 'elnök' */
-    // set handler so the default handler won't terminate the process
-    signal(SIGUSR1, handler);
+    // wait until children are ready, the semaphore can't lose a notification like a signal could
+    sem_op(ready_sem_id, -proc_count);
+    sem_destroy(ready_sem_id);
 
-    // create pipes for communication with children, and pipe for children-to-children
-    for (int i = 0; i < PROC_COUNT; ++i) {
-        char pipe_name[BUFF_SIZE];
-        getPipeName(pipe_name, proc_ids[i], "");
-        if (mkfifo(pipe_name, S_IRUSR|S_IWUSR ) == -1) { ipcError("Pipe creation was unsuccessful."); }
+    // the parent keeps its side of the hops open for every election
+    for (int i = 0; i < worker_count; ++i) {
+        channelOpen(&to_child1[i], O_WRONLY);
     }
-
-    char btw_child_pipe[BUFF_SIZE];
-    getPipeName(btw_child_pipe, getpid(), "_btw_children");
-    if (mkfifo(btw_child_pipe, S_IRUSR|S_IWUSR ) == -1) { ipcError("Pipe creation was unsuccessful."); }
-
-    // wait until children are ready
-    pause();
-    // in case signals fire the same time
-    while (sigCount < PROC_COUNT) {
-        sleep(100);
+    channelOpen(&to_parent, O_RDONLY);
+
+    int result_level = bench == NULL ? LOG_RESULT : LOG_DEBUG; // the results of every benchmark run would bury the report
+    t_vote_batch votes;
+    int *results = histogramCreate();
+    int *histogram = histogramCreate();
+    int *top = (int *) malloc(top_count * sizeof(int));
+    if (top == NULL) { noMemoryError(); }
+    t_writer results_writer;
+    if (results_path != NULL) {
+        t_file_header header = {{'N', 'V', 'P', 'R'}, OUTPUT_VERSION, party_count, sizeof(t_result_record)};
+        writerOpen(&results_writer, results_path, &header);
     }
-    sigCount = 0;
-
-    goOut(sem_id, "parent");
+    struct timespec elections_started;
+    clock_gettime(CLOCK_MONOTONIC, &elections_started);
+
+    for (int election = 1; election <= count; ++election) {
+        goOut(sem_id, "parent");
+        if (count > 1) logWrite(LOG_INFO, "\n~~~~~~~~~ Election %d of %d ~~~~~~~~~\n", election, count);
+
+        // the workers wait for the next election, nobody looks at the ids meanwhile
+        memset(seen_ids, 0, sizeof(t_id_set));
+        memset(results, 0, party_count * sizeof(int));
+
+        // generate voters in a separate thread, so the votes can be received meanwhile
+        t_generator generator = {to_child1, worker_count, voter_count, sem_id, bench, stamps};
+        pthread_t generator_thread;
+        if (pthread_create(&generator_thread, NULL, generateVoters, &generator) != 0) { assertionError("Unable to start the generator."); }
+
+        // receive the vote batches, then the valid / invalid vote rate and the tallies of the voting workers
+        t_stats stats = {0, 0, 0};
+        t_frame frame;
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        int received = 0;
+        while (true) {
+            if (!channelReceive(&to_parent, &frame)) { assertionError("child2 has stopped in the middle of the election."); }
+            if (frame.type == MSG_END) break;
+
+            if (frame.type == MSG_VOTES) {
+                struct timespec batch_start;
+                clock_gettime(CLOCK_MONOTONIC, &batch_start);
+                channelReadPayload(&to_parent, &frame, votes.votes, sizeof(votes.votes));
+                votes.size = frame.length / sizeof(t_vote);
+                received += votes.size;
+                for (size_t i = 0; i < votes.size; ++i) {
+                    logWrite(LOG_TRACE, "parent has received the vote of %d\n", votes.votes[i].id);
+                }
+                benchRecord(bench, STAGE_TALLY, &batch_start, votes.size);
+            } else if (frame.type == MSG_STATS) {
+                channelReadPayload(&to_parent, &frame, &stats, sizeof(stats));
+            } else if (frame.type == MSG_HISTOGRAM) {
+                channelReadPayload(&to_parent, &frame, histogram, party_count * sizeof(int));
+                histogramMerge(results, histogram);
+            } else {
+                assertionError("Unexpected message from child2.");
+            }
+        }
+        pthread_join(generator_thread, NULL);
+        logWrite(LOG_INFO, "parent has received %d votes in %ld ms.\n", received, elapsedMs(&started));
+
+        logWrite(result_level, "parent received the valid/invalid vote rates:\n\tvalid: %d\n\tinvalid: %d (duplicates: %d)\n",
+                 stats.valid_votes, stats.invalid_votes, stats.duplicate_votes);
+        // print stats into file, one per election, the benchmark only reports the measurements
+        if (bench == NULL) {
+            char postfix[BUFF_SIZE], stat_file[BUFF_SIZE];
+            if (count > 1) sprintf(postfix, "_%d.txt", election);
+            else strcpy(postfix, ".txt");
+            getPipeName(stat_file, getpid(), postfix);
+            FILE *fp = fopen(stat_file, "wb+");
+            if (fp == NULL) { fileError("Can't open file."); }
+            fprintf(fp, "valid: %d\ninvalid: %d\nduplicate: %d\n", stats.valid_votes, stats.invalid_votes, stats.duplicate_votes);
+            logWrite(LOG_INFO, "parent has written the rates into file: '%s'\n", stat_file);
+            fclose(fp);
+        }
+        if (results_path != NULL) {
+            t_result_record record = {election, stats.valid_votes, stats.invalid_votes, stats.duplicate_votes};
+            writerWrite(&results_writer, &record, sizeof(record));
+            writerWrite(&results_writer, results, party_count * sizeof(int));
+        }
 
-    // generate voters
-    int count = atoi(argv[1]);
-    t_batch voter_data;
-    batchInit(&voter_data);
-    for (int i = 0; i < count; ++i) {
-        t_data data = {randomBetween(10000, 99999), -1, 0};
-        batchAdd(&voter_data, data);
-    }
+        goOut(sem_id, "parent");
 
-    // send pid of child2 and voters to child1
-    char child1_pipe[BUFF_SIZE];
-    getPipeName(child1_pipe, proc_ids[0], "");
-
-    int child_1_fd = open(child1_pipe, O_WRONLY);
-    write(child_1_fd, &proc_ids[1], sizeof(pid_t)); // send child2 pid first
-    write(child_1_fd, &voter_data.size, sizeof(voter_data.size)); // send count first
-    write(child_1_fd, voter_data.batch, voter_data.size * sizeof(t_data)); // send voters after
-    close(child_1_fd);
-
-    goOut(sem_id, "parent");
-
-    // read the valid / invalid vote rate from child2 pipe
-    char child2_pipe[BUFF_SIZE];
-    getPipeName(child2_pipe, proc_ids[1], "");
-
-    t_stats stats;
-    int child_2_fd = open(child2_pipe, O_RDONLY);
-    read(child_2_fd, &stats, sizeof(stats));
-    printf("parent received the valid/invalid vote rates:\n\tvalid: %d\n\tinvalid: %d\n", stats.valid_votes, stats.invalid_votes); fflush(stdout);
-    // print stats into file
-    char stat_file[BUFF_SIZE];
-    getPipeName(stat_file, getpid(), ".txt");
-    FILE *fp = fopen(stat_file, "wb+");
-    if (fp == NULL) { fileError("Can't open file."); }
-    fprintf(fp, "valid: %d\ninvalid: %d\n", stats.valid_votes, stats.invalid_votes);
-    printf("parent has written the rates into file: '%s'\n", stat_file); fflush(stdout);
-    fclose(fp);
-
-    goOut(sem_id, "parent");
-
-    // wait until all valid voter summit their votes
-    int results[PARTY_COUNT] = {0};
-    int voted = 0;
-    while (voted < stats.valid_votes){
-        t_vote vote;
-        read(child_2_fd, &vote, sizeof(vote));
-        results[vote.party-1]++;
-        printf("parent has received the vote of %d\n", vote.id); fflush(stdout);
-        voted++;
-    }
-    close(child_2_fd);
-
-    goOut(sem_id, "parent");
-
-    printf("\nparent is counting the votes...\n"); fflush(stdout);
-    sleep(2);
-    printf("~~~~~~~~~ The results are ready! ~~~~~~~~~\n"); fflush(stdout);
-    int winnerVotes = -1, winnerParty = -1;
-    for (int i = 0; i < PARTY_COUNT; ++i) {
-        printf("\t%d - %d votes\n", i+1, results[i]); fflush(stdout);
-        if (results[i] > winnerVotes){
-            winnerVotes = results[i];
-            winnerParty = i+1;
+        logWrite(LOG_INFO, "\nparent is counting the votes...\n");
+        takeTime(2000);
+        logWrite(result_level, "~~~~~~~~~ The results are ready! ~~~~~~~~~\n");
+        int listed = topParties(results, top, top_count);
+        if (listed < party_count) logWrite(result_level, "Top %d of %d parties:\n", listed, party_count);
+        for (int i = 0; i < listed; ++i) {
+            logWrite(result_level, "\t%d - %d votes\n", top[i]+1, results[top[i]]);
         }
+        logWrite(result_level, "\nSo the winner is: %d (%d votes)\n", top[0]+1, results[top[0]]);
+    }
+    if (count > 1 && bench == NULL) {
+        double seconds = elapsedNs(&elections_started) / 1e9;
+        logWrite(LOG_RESULT, "\n%d elections in %.3f s: %.2f elections/s\n", count, seconds, count / seconds);
     }
-    printf("\nSo the winner is: %d (%d votes)\n", winnerParty, winnerVotes); fflush(stdout);
+    if (results_path != NULL) writerClose(&results_writer);
+    free(top);
+    free(histogram);
+    free(results);
+
+    // the end of the streams lets the workers go
+    for (int i = 0; i < worker_count; ++i) {
+        channelClose(&to_child1[i]);
+    }
+    channelClose(&to_parent);
 
     // wait until children are done
     pid_t finished_pid;
     while ((finished_pid = waitpid(-1, NULL, 0)) != -1) {
-        for (int i = 0; i < PROC_COUNT; ++i) {
+        for (int i = 0; i < proc_count; ++i) {
             if (proc_ids[i] == finished_pid){
                 // a child has finished
-                // printf("child%d has finished.\n", i+1); fflush(stdout);
+                // logWrite(LOG_DEBUG, "child%d has finished.\n", i+1);
             }
         }
     }
 
-    // unlink pipe files created by parent
-    for (int i = 0; i < PROC_COUNT; ++i) {
-        char pipe_name[BUFF_SIZE];
-        getPipeName(pipe_name, proc_ids[i], "");
-        unlink(pipe_name);
+    // remove the pipes / rings created by parent
+    for (int i = 0; i < worker_count; ++i) {
+        channelDestroy(&to_child1[i]);
+        channelDestroy(&btw_children[i]);
     }
-    unlink(btw_child_pipe);
-    sem_destroy(sem_id); // delete semaphore
-    batchDestroy(&voter_data);
+    channelDestroy(&to_parent);
+    munmap(seen_ids, sizeof(t_id_set));
+    if (stamps != NULL) munmap(stamps, chunk_count * sizeof(t_chunk_stamps));
+}
+
+void runBenchmark(int sem_id, int max_count, int count) {
+    // the stages of every process write into it, so it is shared before forking
+    t_bench *bench = mmap(NULL, sizeof(t_bench), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (bench == MAP_FAILED) { noMemoryError(); }
+
+    logWrite(LOG_RESULT, "Benchmark: %d validator workers, %d parties, %s transport, chunks of %d voters%s, %d election(s) per run\n",
+             worker_count, party_count, transport == TRANSPORT_SHM ? "shm" : transport == TRANSPORT_SPLICE ? "splice" : "fifo", chunk_size, huge_pages ? ", huge pages" : "", count);
+    for (long voters = BENCH_MIN; voters <= max_count; voters *= 10) {
+        memset(bench, 0, sizeof(t_bench));
+
+        struct timespec started;
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        runElections(sem_id, (int) voters, count, bench);
+        benchReport(bench, (int) voters, count, elapsedNs(&started));
+    }
+
+    munmap(bench, sizeof(t_bench));
+}
+
+bool idSetInsert(t_id_set *set, int id) {
+    if (id < ID_MIN || id > ID_MAX) return true; // out of the id space, the validity check rejects it
+
+    // one atomic operation, the other workers may set bits of the same word meanwhile
+    unsigned long bit = 1UL << ((id - ID_MIN) % 64);
+    return !(__atomic_fetch_or(&set->words[(id - ID_MIN) / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+void benchRecord(t_bench *bench, int stage, const struct timespec *since, long items) {
+    if (bench == NULL) return;
+
+    // the validator workers record into the same stage
+    t_stage_timing *timing = &bench->stages[stage];
+    long ns = elapsedNs(since);
+    long ind = __atomic_fetch_add(&timing->count, 1, __ATOMIC_RELAXED);
+    if (ind < BENCH_SAMPLES) timing->samples[ind] = ns;
+    __atomic_fetch_add(&timing->items, items, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&timing->busy, ns, __ATOMIC_RELAXED);
+}
+
+void benchReport(t_bench *bench, int count, int elections, long total_ns) {
+    static const char *stage_names[STAGE_COUNT] = {"generation", "validation", "stats", "voting", "tally"};
+
+    double seconds = total_ns / 1e9;
+    logWrite(LOG_RESULT, "\n%d x %d voters in %.3f s: %.0f voters/s, %.2f elections/s\n",
+             elections, count, seconds, (double) elections * count / seconds, elections / seconds);
+    logWrite(LOG_RESULT, "\t%-10s %10s %10s %10s %10s %10s %14s\n", "stage", "chunks", "p50 us", "p90 us", "p99 us", "max us", "items/s busy");
+    for (int i = 0; i < STAGE_COUNT; ++i) {
+        t_stage_timing *timing = &bench->stages[i];
+        long n = timing->count < BENCH_SAMPLES ? timing->count : BENCH_SAMPLES;
+        if (n == 0) continue;
+
+        qsort(timing->samples, n, sizeof(long), compareLong);
+        logWrite(LOG_RESULT, "\t%-10s %10ld %10.1f %10.1f %10.1f %10.1f %14.0f\n", stage_names[i], timing->count,
+                 timing->samples[n * 50 / 100] / 1e3, timing->samples[n * 90 / 100] / 1e3,
+                 timing->samples[n * 99 / 100] / 1e3, timing->samples[n - 1] / 1e3,
+                 timing->busy > 0 ? timing->items / (timing->busy / 1e9) : 0.0);
+    }
+}
+
+void writerOpen(t_writer *writer, const char *path, const t_file_header *header) {
+    writer->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+    if (writer->fd == -1) { fileError("Can't open the output file."); }
+
+    for (int i = 0; i < 2; ++i) {
+        writer->buffers[i] = mmap(NULL, WRITER_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (writer->buffers[i] == MAP_FAILED) { noMemoryError(); }
+    }
+    writer->filling = 0;
+    writer->len = writer->pending = 0;
+    writer->closing = false;
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    if (pthread_create(&writer->thread, NULL, writerMain, writer) != 0) { assertionError("Unable to start the writer."); }
+
+    writerWrite(writer, header, sizeof(*header));
+}
+
+void writerWrite(t_writer *writer, const void *data, size_t len) {
+    const char *bytes = (const char *) data;
+    while (len > 0) {
+        // hand the full buffer over to the thread, the other one is free by then in most cases
+        if (writer->len == WRITER_BUFFER_SIZE) {
+            pthread_mutex_lock(&writer->mutex);
+            while (writer->pending > 0) pthread_cond_wait(&writer->cond, &writer->mutex);
+            writer->pending = writer->len;
+            writer->filling ^= 1;
+            writer->len = 0;
+            pthread_cond_broadcast(&writer->cond);
+            pthread_mutex_unlock(&writer->mutex);
+        }
+
+        size_t part = WRITER_BUFFER_SIZE - writer->len;
+        if (part > len) part = len;
+        memcpy(writer->buffers[writer->filling] + writer->len, bytes, part);
+        writer->len += part;
+        bytes += part;
+        len -= part;
+    }
+}
+
+void writerClose(t_writer *writer) {
+    // the last, partly filled buffer goes the same way
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->pending > 0) pthread_cond_wait(&writer->cond, &writer->mutex);
+    writer->pending = writer->len;
+    writer->filling ^= 1;
+    writer->closing = true;
+    pthread_cond_broadcast(&writer->cond);
+    pthread_mutex_unlock(&writer->mutex);
+    pthread_join(writer->thread, NULL);
+
+    close(writer->fd);
+    for (int i = 0; i < 2; ++i) {
+        munmap(writer->buffers[i], WRITER_BUFFER_SIZE);
+    }
+    pthread_mutex_destroy(&writer->mutex);
+    pthread_cond_destroy(&writer->cond);
+}
+
+void *writerMain(void *args) {
+    t_writer *writer = (t_writer *) args;
+
+    pthread_mutex_lock(&writer->mutex);
+    while (true) {
+        while (writer->pending == 0 && !writer->closing) pthread_cond_wait(&writer->cond, &writer->mutex);
+        if (writer->pending == 0) break;
+
+        // the buffer not being filled, the filling goes on while it's written out
+        char *buffer = writer->buffers[writer->filling ^ 1];
+        size_t len = writer->pending;
+        pthread_mutex_unlock(&writer->mutex);
+
+        struct iovec iov = {buffer, len};
+        writeFull(writer->fd, &iov, 1);
+
+        pthread_mutex_lock(&writer->mutex);
+        writer->pending = 0;
+        pthread_cond_broadcast(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return NULL;
 }
 
 void goOut(int sem_id, char *proc_name) {
     // probability of going out: 30%
-    if (randomBetween(1, 100) > 70) {
-        printf("%s wants to go out...\n", proc_name); fflush(stdout);
+    if (!benchmark && randomBetween(1, 100) > 70) {
+        logWrite(LOG_INFO, "%s wants to go out...\n", proc_name);
         sem_op(sem_id, -1);
-        printf("%s went out to take a brake.\n", proc_name); fflush(stdout);
+        logWrite(LOG_INFO, "%s went out to take a brake.\n", proc_name);
         sleep(5);
-        printf("%s came back.\n", proc_name); fflush(stdout);
+        logWrite(LOG_INFO, "%s came back.\n", proc_name);
         sem_op(sem_id, 1);
     }
 }
 
+void logWrite(int level, const char *format, ...) {
+    if (level > log_level) return;
+
+    pthread_mutex_lock(&log_mutex);
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(log_buffer + log_len, LOG_BUFFER_SIZE - log_len, format, args);
+    va_end(args);
+
+    // the line didn't fit, write out the ones before it and format it again
+    if (len > 0 && log_len + len >= LOG_BUFFER_SIZE && log_len > 0) {
+        logWriteOut();
+        va_start(args, format);
+        len = vsnprintf(log_buffer, LOG_BUFFER_SIZE, format, args);
+        va_end(args);
+    }
+    if (len > 0) log_len += (size_t) len < LOG_BUFFER_SIZE - log_len ? (size_t) len : LOG_BUFFER_SIZE - log_len - 1;
+
+    // the high volume lines stay in the buffer, the rest shows the progress right away
+    if (level <= LOG_INFO) logWriteOut();
+    pthread_mutex_unlock(&log_mutex);
+}
+
+void logFlush(void) {
+    pthread_mutex_lock(&log_mutex);
+    logWriteOut();
+    pthread_mutex_unlock(&log_mutex);
+}
+
+void takeTime(long ms) {
+    if (benchmark) return;
+    struct timespec duration = {ms / 1000, (ms % 1000) * 1000000};
+    while (nanosleep(&duration, &duration) != 0 && errno == EINTR) { }
+}
+
 void getPipeName(char *name_buff, int pid, char *postfix){
     sprintf(name_buff,"/tmp/nvp190_%d%s", pid, postfix);
 }
 
-void batchInit(t_batch *batch) {
+void batchInit(t_batch *batch, size_t cap) {
     batch->size = 0;
-    batch->cap = 10;
+    batch->cap = 0;
+    batch->batch = NULL;
 
-    // initial allocation
-    batch->batch = (t_data *)malloc(batch->cap * sizeof(t_data));
-    if (batch->batch == NULL){ noMemoryError(); }
+    // the whole capacity at once, the stages know the size of their chunks up front
+    dataAlloc(batch, cap > 0 ? cap : 1);
 }
 
 void batchAdd(t_batch *batch, t_data data){
-    // increase size when full
+    // increase size when full, it only happens if the batch was sized too small
     if (batch->size == batch->cap)
     {
-        t_data *new_batch = (t_data *)realloc(batch->batch, batch->cap * 2 * sizeof(t_data));
-        if (new_batch == NULL){ noMemoryError(); }
-
-        batch->batch  = new_batch;
-        batch->cap *= 2;
+        dataAlloc(batch, batch->cap * 2);
     }
 
     batch->batch[batch->size++] = data;
 }
 
+void batchReserve(t_batch *batch, size_t cap) {
+    if (batch->cap < cap) {
+        dataAlloc(batch, cap);
+    }
+}
+
+void batchReadPayload(t_channel *channel, const t_frame *frame, t_batch *batch) {
+    if (frame->type != MSG_VOTERS) { assertionError("Unexpected message instead of voters."); }
+
+    batchReserve(batch, frame->length / sizeof(t_data));
+    channelReadPayload(channel, frame, batch->batch, batch->cap * sizeof(t_data));
+    batch->size = frame->length / sizeof(t_data);
+}
+
+void batchSend(t_channel *channel, t_batch *batch) {
+    if (transport == TRANSPORT_SPLICE && batch->size > 0) {
+        // the pages of the voters are handed over to the pipe without copying, the reader still copies them out,
+        // so only the copy of the writer is saved: it pays off with many full chunks, short runs are on par with fifo
+        t_frame frame = {MSG_VOTERS, batch->size * sizeof(t_data)};
+        channelWrite(channel, &frame, sizeof(frame));
+        channelSplice(channel, batch->batch, frame.length);
+
+        // the pipe holds one chunk at most, so once a whole chunk is in, the reader is past the pages before it:
+        // the pages of the previous chunk are filled next, new ones are only mapped after a short chunk
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        t_batch spliced = *batch;
+        if (channel->spare.batch != NULL && channel->spare.cap == batch->cap &&
+            (frame.length + page - 1) / page >= channel->pipe_pages) {
+            *batch = channel->spare;
+            batch->size = spliced.size;
+        } else {
+            dataFree(&channel->spare); // the pipe keeps the pages it still needs
+            batch->batch = NULL;
+            dataAlloc(batch, spliced.cap);
+        }
+        channel->spare = spliced;
+    } else {
+        channelSend(channel, MSG_VOTERS, batch->batch, batch->size * sizeof(t_data));
+    }
+}
+
+void voteAdd(t_channel *channel, t_vote_batch *votes, t_vote vote) {
+    if (votes->size == 0) clock_gettime(CLOCK_MONOTONIC, &votes->since);
+    votes->votes[votes->size++] = vote;
+
+    if (votes->size == VOTE_BATCH_SIZE || elapsedMs(&votes->since) >= VOTE_FLUSH_MS)
+        voteFlush(channel, votes);
+}
+
+void voteFlush(t_channel *channel, t_vote_batch *votes) {
+    channelSend(channel, MSG_VOTES, votes->votes, votes->size * sizeof(t_vote));
+    votes->size = 0;
+}
+
+void *generateVoters(void *args) {
+    t_generator *generator = (t_generator *) args;
+
+    // generate and send the voters chunk by chunk, so the validators can start checking right away
+    // the chunks are dealt out to the validator workers in turn
+    t_batch voter_data;
+    batchInit(&voter_data, generator->count < chunk_size ? generator->count : chunk_size);
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int worker = 0;
+    struct timespec chunk_start;
+    for (int i = 0; i < generator->count; ++i) {
+        if (voter_data.size == 0) clock_gettime(CLOCK_MONOTONIC, &chunk_start);
+        t_data data = {randomBetween(ID_MIN, ID_MAX), -1, 0, REJECT_NONE};
+        batchAdd(&voter_data, data);
+
+        if (voter_data.size == (size_t) chunk_size || i == generator->count - 1) {
+            benchRecord(generator->bench, STAGE_GENERATION, &chunk_start, voter_data.size);
+            if (generator->stamps != NULL) generator->stamps[i / chunk_size].generated = nowNs();
+            batchSend(&generator->channels[worker], &voter_data);
+            worker = (worker + 1) % generator->channel_count;
+            voter_data.size = 0;
+        }
+    }
+    logWrite(LOG_INFO, "parent has generated %d voters in %ld ms.\n", generator->count, elapsedMs(&started));
+
+    goOut(generator->sem_id, "parent");
+
+    // the end of the election tells the validators that there are no more voters
+    for (int i = 0; i < generator->channel_count; ++i) {
+        channelSend(&generator->channels[i], MSG_END, NULL, 0);
+    }
+
+    batchDestroy(&voter_data);
+    return NULL;
+}
+
+int *histogramCreate(void) {
+    int *histogram = (int *) calloc(party_count, sizeof(int));
+    if (histogram == NULL){ noMemoryError(); }
+    return histogram;
+}
+
+void histogramMerge(int *into, const int *histogram) {
+    for (int i = 0; i < party_count; ++i) {
+        into[i] += histogram[i];
+    }
+}
+
+int topParties(const int *results, int *top, int k) {
+    // keep the best k in descending order, only the parties beating the last one have to be placed
+    int count = 0;
+    for (int i = 0; i < party_count; ++i) {
+        if (count == k && results[i] <= results[top[k-1]]) continue;
+
+        int pos = count < k ? count++ : k - 1;
+        while (pos > 0 && results[top[pos-1]] < results[i]) {
+            top[pos] = top[pos-1];
+            pos--;
+        }
+        top[pos] = i;
+    }
+
+    return count;
+}
+
 void batchDestroy(t_batch *batch) {
+    dataFree(batch);
     batch->size = 0;
-    batch->cap = 0;
+}
+
+void dataAlloc(t_batch *batch, size_t cap) {
+    // whole pages of their own, so they can be spliced into the pipe in splice mode
+    // the pages are populated up front, the stages don't fault in the middle of a chunk
+    t_data *new_batch = MAP_FAILED;
+    if (batch->batch != NULL) {
+        // a mapping keeps its kind of pages, so it is resized in the same units
+        new_batch = mremap(batch->batch, dataMapSize(batch->cap, batch->huge), dataMapSize(cap, batch->huge), MREMAP_MAYMOVE);
+    } else {
+        batch->huge = false;
+        if (huge_pages) {
+            new_batch = mmap(NULL, dataMapSize(cap, true), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE | MAP_HUGETLB, -1, 0);
+            batch->huge = new_batch != MAP_FAILED;
+        }
+        if (new_batch == MAP_FAILED) {
+            new_batch = mmap(NULL, dataMapSize(cap, false), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+            // no huge pages are reserved, transparent ones may still back it
+            if (new_batch != MAP_FAILED && huge_pages) madvise(new_batch, dataMapSize(cap, false), MADV_HUGEPAGE);
+        }
+    }
+
+    if (new_batch == MAP_FAILED){ noMemoryError(); }
+    batch->batch = new_batch;
+    batch->cap = cap;
+}
 
-    free(batch->batch);
+void dataFree(t_batch *batch) {
+    if (batch->batch != NULL) munmap(batch->batch, dataMapSize(batch->cap, batch->huge));
     batch->batch = NULL;
+    batch->cap = 0;
+}
+
+void channelCreate(t_channel *channel, char *postfix) {
+    channel->fd = -1;
+    channel->ring = NULL;
+    channel->sem_id = -1;
+    channel->pos = channel->offset = 0;
+    channel->ahead = NULL;
+    channel->ahead_pos = channel->ahead_len = 0;
+    channel->pipe_pages = 0;
+    memset(&channel->spare, 0, sizeof(channel->spare));
+    getPipeName(channel->name, getpid(), postfix);
+
+    if (transport == TRANSPORT_SHM) {
+        int shm_id = shmget(IPC_PRIVATE, sizeof(t_ring), IPC_CREAT | S_IRUSR | S_IWUSR);
+        if (shm_id < 0) { ipcError("Shared memory creation was unsuccessful."); }
+        channel->ring = (t_ring *) shmat(shm_id, NULL, 0);
+        shmctl(shm_id, IPC_RMID, NULL); // removed automatically when every stage has detached
+        if (channel->ring == (void *) -1) { ipcError("Shared memory attach was unsuccessful."); }
+
+        unsigned short sem_vals[2] = {RING_SLOTS, 0}; // every slot is free at the start
+        channel->sem_id = sem_create_private(2, sem_vals);
+    } else {
+        if (mkfifo(channel->name, S_IRUSR|S_IWUSR ) == -1) { ipcError("Pipe creation was unsuccessful."); }
+    }
+}
+
+void channelOpen(t_channel *channel, int flags) {
+    channel->flags = flags;
+    if (transport != TRANSPORT_SHM) {
+        channel->fd = open(channel->name, flags);
+        if (channel->fd == -1) { ipcError("Pipe opening was unsuccessful."); }
+
+        if (flags == O_RDONLY) {
+            channel->ahead = (char *) malloc(READ_AHEAD_SIZE);
+            if (channel->ahead == NULL){ noMemoryError(); }
+        } else if (transport == TRANSPORT_SPLICE) {
+            // no more than a chunk fits into the pipe, the spliced pages can be reused after the next chunk
+            size_t page = (size_t) sysconf(_SC_PAGESIZE), size = page;
+            while (size * 2 <= chunk_size * sizeof(t_data)) size *= 2;
+            int pipe_size = fcntl(channel->fd, F_SETPIPE_SZ, (int) size);
+            if (pipe_size < 0) pipe_size = fcntl(channel->fd, F_GETPIPE_SZ);
+            channel->pipe_pages = pipe_size > 0 ? (size_t) pipe_size / page : SIZE_MAX; // unknown: never reused
+        }
+    }
+}
+
+void channelWrite(t_channel *channel, const void *buf, size_t len) {
+    if (transport != TRANSPORT_SHM) {
+        struct iovec iov = {(void *) buf, len};
+        writeFull(channel->fd, &iov, 1);
+        return;
+    }
+
+    const char *data = (const char *) buf;
+    while (len > 0) {
+        size_t part = len < RING_SLOT_SIZE ? len : RING_SLOT_SIZE;
+        t_ring_slot *slot = &channel->ring->slots[channel->pos];
+
+        sem_op_at(channel->sem_id, SEM_FREE, -1); // wait for a free slot
+        memcpy(slot->data, data, part);
+        slot->len = part;
+        sem_op_at(channel->sem_id, SEM_FILLED, 1);
+
+        channel->pos = (channel->pos + 1) % RING_SLOTS;
+        data += part;
+        len -= part;
+    }
+}
+
+void channelSend(t_channel *channel, int type, const void *payload, size_t len) {
+    t_frame frame = {type, len};
+    if (transport == TRANSPORT_SHM) {
+        channelWrite(channel, &frame, sizeof(frame));
+        channelWrite(channel, payload, len);
+        return;
+    }
+
+    // one syscall for the header and the payload
+    struct iovec iov[2] = {{&frame, sizeof(frame)}, {(void *) payload, len}};
+    writeFull(channel->fd, iov, 2);
+}
+
+bool channelReceive(t_channel *channel, t_frame *frame) {
+    return channelRead(channel, frame, sizeof(*frame)) == sizeof(*frame);
+}
+
+void channelReadPayload(t_channel *channel, const t_frame *frame, void *buf, size_t size) {
+    if (frame->length > size) { assertionError("Message is larger than its buffer."); }
+    if (channelRead(channel, buf, frame->length) != frame->length) { ipcError("Message was cut off."); }
+}
+
+void channelSplice(t_channel *channel, void *buf, size_t len) {
+    struct iovec iov = {buf, len};
+    while (iov.iov_len > 0) {
+        ssize_t n = vmsplice(channel->fd, &iov, 1, 0); // not gifted, the pages are filled again later
+        if (n <= 0) { ipcError("Splicing into the pipe was unsuccessful."); }
+
+        iov.iov_base = (char *) iov.iov_base + n;
+        iov.iov_len -= n;
+    }
+}
+
+size_t channelRead(t_channel *channel, void *buf, size_t len) {
+    char *data = (char *) buf;
+    size_t done = 0;
+
+    if (transport != TRANSPORT_SHM) {
+        // the bytes read ahead last time come first
+        size_t part = channel->ahead_len - channel->ahead_pos;
+        if (part > len) part = len;
+        memcpy(data, channel->ahead + channel->ahead_pos, part);
+        channel->ahead_pos += part;
+        done += part;
+
+        // whatever follows the requested bytes goes to the read-ahead buffer, so the next header needs no syscall
+        while (done < len) {
+            struct iovec iov[2] = {{data + done, len - done}, {channel->ahead, READ_AHEAD_SIZE}};
+            ssize_t n = readv(channel->fd, iov, 2);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break; // end of the stream
+
+            if ((size_t) n > len - done) {
+                channel->ahead_pos = 0;
+                channel->ahead_len = n - (len - done);
+                n = len - done;
+            }
+            done += n;
+        }
+        return done;
+    }
+
+    while (done < len) {
+        t_ring_slot *slot = &channel->ring->slots[channel->pos];
+
+        if (channel->offset == 0) sem_op_at(channel->sem_id, SEM_FILLED, -1); // wait for a filled slot
+        if (slot->len == 0) { // end of the stream, leave the marker for the next read
+            sem_op_at(channel->sem_id, SEM_FILLED, 1);
+            break;
+        }
+
+        size_t part = slot->len - channel->offset;
+        if (part > len - done) part = len - done;
+        memcpy(data + done, slot->data + channel->offset, part);
+        channel->offset += part;
+        done += part;
+
+        if (channel->offset == slot->len) { // slot is consumed, give it back to the writer
+            channel->offset = 0;
+            channel->pos = (channel->pos + 1) % RING_SLOTS;
+            sem_op_at(channel->sem_id, SEM_FREE, 1);
+        }
+    }
+
+    return done;
+}
+
+void channelClose(t_channel *channel) {
+    if (transport != TRANSPORT_SHM) {
+        close(channel->fd);
+        channel->fd = -1;
+        free(channel->ahead);
+        channel->ahead = NULL;
+        dataFree(&channel->spare);
+    } else if (channel->flags == O_WRONLY) {
+        // an empty slot marks the end of the stream
+        sem_op_at(channel->sem_id, SEM_FREE, -1);
+        channel->ring->slots[channel->pos].len = 0;
+        sem_op_at(channel->sem_id, SEM_FILLED, 1);
+    }
+}
+
+void channelDestroy(t_channel *channel) {
+    if (transport == TRANSPORT_SHM) {
+        shmdt(channel->ring);
+        sem_destroy(channel->sem_id);
+    } else {
+        unlink(channel->name);
+    }
 }
 
 int sem_create(const char* pathname, int sem_val){
@@ -386,15 +1235,35 @@ int sem_create(const char* pathname, int sem_val){
 }
 
 
+int sem_create_private(int sem_count, unsigned short *sem_vals){
+    int sem_id = semget(IPC_PRIVATE, sem_count, IPC_CREAT | S_IRUSR | S_IWUSR);
+    if (sem_id < 0) { ipcError("Semaphore creation was unsuccessful."); }
+
+    union { int val; struct semid_ds *buf; unsigned short *array; } arg;
+    arg.array = sem_vals;
+    if(semctl(sem_id, 0, SETALL, arg) < 0)
+        perror("semctl");
+
+    return sem_id;
+}
+
 void sem_op(int sem_id, int op){
+    sem_op_at(sem_id, 0, op);
+}
+
+void sem_op_at(int sem_id, int sem_num, int op){
     struct sembuf operation;
 
-    operation.sem_num = 0;
+    operation.sem_num = sem_num;
     operation.sem_op  = op; // op=1 up, op=-1 down
     operation.sem_flg = 0;
 
-    if(semop(sem_id,&operation,1)<0) // 1 number of sem. operations
-        perror("semop");
+    while(semop(sem_id,&operation,1)<0){ // 1 number of sem. operations
+        if (errno != EINTR) { // on EINTR a signal interrupted the wait, so try again
+            perror("semop");
+            break;
+        }
+    }
 }
 
 void sem_destroy(int sem_id){
@@ -402,29 +1271,93 @@ void sem_destroy(int sem_id){
 }
 
 void noMemoryError(void){
+    logFlush();
     fprintf(stderr, "\nOut of memory!");
     exit(1);
 }
 
 void fileError(const char *msg){
+    logFlush();
     fprintf(stderr, "%s %s\n", "File error: ", msg);
     exit(1);
 }
 
 void ipcError(const char *msg){
+    logFlush();
     fprintf(stderr, "%s %s\n", "IPC error: ", msg);
     exit(1);
 }
 
 void assertionError(const char *msg){
+    logFlush();
     fprintf(stderr, "%s %s\n", "Assertion error: ", msg);
     exit(1);
 }
 
+static size_t dataMapSize(size_t cap, bool huge){
+    size_t page = huge ? HUGE_PAGE_SIZE : (size_t) sysconf(_SC_PAGESIZE);
+    return (cap * sizeof(t_data) + page - 1) / page * page;
+}
+
 static int randomBetween(int lower, int upper){
     return (rand() % (upper - lower + 1)) + lower;
 }
 
+static void writeFull(int fd, struct iovec *iov, int count){
+    while (count > 0) {
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) { ipcError("Writing into the pipe was unsuccessful."); }
+
+        // skip the parts written completely, then the written beginning of the next one
+        while (count > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static void logWriteOut(void){
+    // whole lines in one write, so the lines of the processes don't break into each other
+    // errors are ignored here, the error handlers log too
+    size_t done = 0;
+    while (done < log_len) {
+        ssize_t n = write(STDOUT_FILENO, log_buffer + done, log_len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        done += n;
+    }
+    log_len = 0;
+}
+
+static long elapsedMs(const struct timespec *since){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static long elapsedNs(const struct timespec *since){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000000L + (now.tv_nsec - since->tv_nsec);
+}
+
+static long nowNs(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static int compareLong(const void *a, const void *b){
+    long x = *(const long *) a, y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
 static void emptyBuffer(void){
     int c;
     while ((c = getchar()) != '\n' && c != EOF) { }